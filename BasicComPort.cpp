@@ -0,0 +1,10 @@
+#include "BasicComPort.h"
+
+namespace kylsocomport
+{
+
+// Compile all methods of ports of library configs.
+template class BasicComPort<ThreadedComPortConfig>;
+template class BasicComPort<PolledComPortConfig>;
+
+} // kylsocomport
@@ -0,0 +1,783 @@
+#pragma once
+
+#include "ComPortCommon.h"
+#include <windows.h>
+#include <array>
+#include <mutex>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <type_traits>
+
+namespace kylsocomport
+{
+
+// Who does io of port.
+enum class ThreadingModel
+{
+	INTERNAL_THREADS,	// Own rx and tx threads, like ComPort.
+	CALLER_POLL			// No threads, io is done in poll() of user event loop.
+};
+
+// Lock policy for single-threaded use, all locks compile away.
+struct NullLock
+{
+	void lock() {}
+	void unlock() {}
+	bool try_lock() { return true; }
+};
+
+// Config for BasicComPort with own threads, std::mutex and std::function callbacks.
+struct ThreadedComPortConfig
+{
+	static const size_t RX_QUEUE_SIZE = 512;
+	static const size_t TX_QUEUE_SIZE = 512;
+	static const ThreadingModel THREADING = ThreadingModel::INTERNAL_THREADS;
+	using Lock = std::mutex;
+	using Callback = std::function<void(void)>;
+};
+
+// Config for BasicComPort in single-threaded event loop: no threads, no locks,
+// callbacks are plain functions.
+struct PolledComPortConfig
+{
+	static const size_t RX_QUEUE_SIZE = 512;
+	static const size_t TX_QUEUE_SIZE = 512;
+	static const ThreadingModel THREADING = ThreadingModel::CALLER_POLL;
+	using Lock = NullLock;
+	using Callback = void (*)(void);
+};
+
+namespace detail
+{
+
+// Fifo with capacity fixed at compile time.
+template <size_t Size, class T = uint8_t>
+class StaticRing final
+{
+public:
+	size_t size() const
+	{
+		return this->size_;
+	}
+
+	size_t freeSize() const
+	{
+		return Size - this->size_;
+	}
+
+	// Return pointer to continuous part of data and its size in count.
+	const T* front(size_t& count) const
+	{
+		count = std::min<size_t>(this->size_, Size - this->head_);
+		return this->data_.data() + this->head_;
+	}
+
+	// Remove count of data from begin.
+	void drop(size_t count)
+	{
+		this->head_ = (this->head_ + count) % Size;
+		this->size_ -= count;
+	}
+
+	// Return pointer to continuous part of free place and its size in count.
+	T* back(size_t& count)
+	{
+		size_t tail = (this->head_ + this->size_) % Size;
+		count = std::min<size_t>(this->freeSize(), Size - tail);
+		return this->data_.data() + tail;
+	}
+
+	// Add count of data written to free place.
+	void commit(size_t count)
+	{
+		this->size_ += count;
+	}
+
+	// Copy data into fifo. Return count of copied data.
+	size_t push(const T* data, size_t count)
+	{
+		size_t pushCount = 0, partCount;
+		while (pushCount < count && this->freeSize() != 0)
+		{
+			T* part = this->back(partCount);
+			partCount = std::min<size_t>(partCount, count - pushCount);
+			std::memcpy(part, data + pushCount, partCount * sizeof(T));
+			this->commit(partCount);
+			pushCount += partCount;
+		}
+		return pushCount;
+	}
+
+	void clear()
+	{
+		this->head_ = 0;
+		this->size_ = 0;
+	}
+
+private:
+	std::array<T, Size>			data_;
+	size_t						head_ = 0;
+	size_t						size_ = 0;
+};
+
+// Fields of threads, they exist only in INTERNAL_THREADS model.
+template <ThreadingModel Threading>
+struct ThreadingFields
+{
+};
+
+template <>
+struct ThreadingFields<ThreadingModel::INTERNAL_THREADS>
+{
+	std::thread					rxThread;
+	std::thread					txThread;
+	std::condition_variable_any	releaseTxThread;
+};
+
+} // detail
+
+// Serial port with settings fixed at compile time by Config:
+// RX_QUEUE_SIZE, TX_QUEUE_SIZE - capacity of rx and tx fifo;
+// THREADING - own threads or poll() from user loop;
+// Lock - type of mutex (NullLock for single thread);
+// Callback - type of callback, called as callback().
+// Machinery, which is not used by Config, is not compiled in.
+// Derived - port, which extends this core (ComPort adds tx lanes, broadcast rx,
+// compression and rx modes). It can hide hooks of io and threads: initIo(),
+// closeIo(), startThreads() and stopThreads(), they are called for it.
+template <class Config, class Derived = void>
+class BasicComPort
+{
+public:
+	using Result = kylsocomport::Result;
+	using Baudrate = kylsocomport::Baudrate;
+	using WordLength = kylsocomport::WordLength;
+	using StopBits = kylsocomport::StopBits;
+	using Parity = kylsocomport::Parity;
+	using Event = kylsocomport::Event;
+	using Callback = typename Config::Callback;
+	using Lock = typename Config::Lock;
+
+	static const bool IS_THREADED = (Config::THREADING == ThreadingModel::INTERNAL_THREADS);
+
+	static_assert(!IS_THREADED || !std::is_same<Lock, NullLock>::value,
+				  "ThreadingModel::INTERNAL_THREADS needs real Lock, not NullLock");
+
+	BasicComPort(uint8_t portNum, Baudrate baudrate, WordLength wordLength,
+				 StopBits stopBits, Parity parity) :
+		portNum_(portNum), baudrate_(baudrate), wordLength_(wordLength),
+		stopBits_(stopBits), parity_(parity), rxDataCallback_(), txDataCallback_(),
+		shutdownCallback_()
+	{
+		this->hComPort_ = nullptr;
+		std::memset(&(this->hRxOverlapped_), 0, sizeof(this->hRxOverlapped_));
+		std::memset(&(this->hTxOverlapped_), 0, sizeof(this->hTxOverlapped_));
+		this->isOpen_ = false;
+		this->openCount_ = 0;
+		this->isTxPending_ = false;
+		this->txPushCount_ = 0;
+		this->txWriteCount_ = 0;
+	}
+
+	~BasicComPort()
+	{
+		this->close();
+	}
+
+	BasicComPort(const BasicComPort&) = delete;
+	BasicComPort& operator=(const BasicComPort&) = delete;
+
+	Result open()
+	{
+		if (this->isOpen_)
+		{
+			return Result::ERROR_ALREADY_OPEN;
+		}
+		Result result = openPortHandle(this->portNum_, this->baudrate_, this->wordLength_,
+									   this->stopBits_, this->parity_, this->hComPort_);
+		if (result != Result::SUCCESS)
+		{
+			return result;
+		}
+		result = this->port().initIo();
+		if (result != Result::SUCCESS)
+		{
+			this->close();
+			return result;
+		}
+		this->openCount_++;
+		this->isOpen_ = true;
+		result = this->port().startThreads(std::integral_constant<bool, IS_THREADED>());
+		if (result != Result::SUCCESS)
+		{
+			this->close();
+			return result;
+		}
+		return Result::SUCCESS;
+	}
+
+	void close()
+	{
+		// Closed port has no handle. Destructor of core also gets here, when
+		// derived port is already closed and destroyed, so hooks aren't called.
+		if (this->hComPort_ == nullptr)
+		{
+			return;
+		}
+		this->isOpen_ = false;
+		this->port().stopThreads(std::integral_constant<bool, IS_THREADED>());
+		this->port().closeIo();
+		CloseHandle(this->hComPort_);
+		if (this->hRxOverlapped_.hEvent != nullptr) CloseHandle(this->hRxOverlapped_.hEvent);
+		if (this->hTxOverlapped_.hEvent != nullptr) CloseHandle(this->hTxOverlapped_.hEvent);
+		this->hComPort_ = nullptr;
+		this->hRxOverlapped_.hEvent = nullptr;
+		this->hTxOverlapped_.hEvent = nullptr;
+		this->isTxPending_ = false;
+
+		std::lock_guard<Lock> lock(this->queueLock_);
+		this->rxQueue_.clear();
+		this->txQueue_.clear();
+		this->txCallEnds_.clear();
+		this->txPushCount_ = 0;
+		this->txWriteCount_ = 0;
+	}
+
+	bool isOpen() const
+	{
+		return this->isOpen_;
+	}
+
+	// Return count of open() calls, which opened port. Change of it shows
+	// that port was reopened and data of tx fifo was dropped by close().
+	uint32_t getOpenCount() const
+	{
+		return this->openCount_;
+	}
+
+	bool setPortNum(uint8_t portNum)
+	{
+		if (this->isOpen_ || portNum == 0)
+		{
+			return false;
+		}
+		else
+		{
+			this->portNum_ = portNum;
+			return true;
+		}
+	}
+
+	uint8_t getPortNum() const
+	{
+		return this->portNum_;
+	}
+
+	bool setBaudrate(Baudrate baudrate)
+	{
+		if (this->isOpen_)
+		{
+			return false;
+		}
+		else
+		{
+			this->baudrate_ = baudrate;
+			return true;
+		}
+	}
+
+	Baudrate getBaudrate() const
+	{
+		return this->baudrate_;
+	}
+
+	bool setWordLength(WordLength wordLength)
+	{
+		if (this->isOpen_)
+		{
+			return false;
+		}
+		else
+		{
+			this->wordLength_ = wordLength;
+			return true;
+		}
+	}
+
+	WordLength getWordLength() const
+	{
+		return this->wordLength_;
+	}
+
+	bool setStopBits(StopBits stopBits)
+	{
+		if (this->isOpen_)
+		{
+			return false;
+		}
+		else
+		{
+			this->stopBits_ = stopBits;
+			return true;
+		}
+	}
+
+	StopBits getStopBits() const
+	{
+		return this->stopBits_;
+	}
+
+	bool setParity(Parity parity)
+	{
+		if (this->isOpen_)
+		{
+			return false;
+		}
+		else
+		{
+			this->parity_ = parity;
+			return true;
+		}
+	}
+
+	Parity getParity() const
+	{
+		return this->parity_;
+	}
+
+	// Return count of data in rx fifo.
+	size_t getRxDataCount()
+	{
+		std::lock_guard<Lock> lock(this->queueLock_);
+		return this->rxQueue_.size();
+	}
+
+	// Get data from rx fifo into buffer. Return count of read data.
+	size_t rxData(uint8_t* data, size_t count)
+	{
+		std::lock_guard<Lock> lock(this->queueLock_);
+		size_t readCount = 0, partCount;
+		while (readCount < count && this->rxQueue_.size() != 0)
+		{
+			const uint8_t* part = this->rxQueue_.front(partCount);
+			partCount = std::min<size_t>(partCount, count - readCount);
+			std::memcpy(data + readCount, part, partCount);
+			this->rxQueue_.drop(partCount);
+			readCount += partCount;
+		}
+		return readCount;
+	}
+
+	// Put all data into tx fifo or nothing, if there is no place.
+	// TX_DATA is called once, when all data of call is written.
+	// Empty data is not sent and gives no TX_DATA.
+	Result txData(const uint8_t* data, size_t count)
+	{
+		std::unique_lock<Lock> lock(this->queueLock_);
+		if (!this->isOpen_)
+		{
+			return Result::ERROR_PORT_CLOSE;
+		}
+		if (count > this->txQueue_.freeSize())
+		{
+			return Result::ERROR_TX_QUEUE_FULL;
+		}
+		if (count == 0)
+		{
+			return Result::SUCCESS;
+		}
+		this->txQueue_.push(data, count);
+		this->txPushCount_ += static_cast<uint32_t>(count);
+		this->txCallEnds_.push(&this->txPushCount_, 1);
+		lock.unlock();
+		this->releaseTxThread(std::integral_constant<bool, IS_THREADED>());
+		return Result::SUCCESS;
+	}
+
+	// Set callback of event (one per event). Possible only if port is closed.
+	bool setCallback(Event event, Callback callback)
+	{
+		if (this->isOpen_)
+		{
+			return false;
+		}
+		if (event == Event::RX_DATA)
+		{
+			this->rxDataCallback_ = callback;
+		}
+		else if (event == Event::TX_DATA)
+		{
+			this->txDataCallback_ = callback;
+		}
+		else // event == Event::SHUTDOWN
+		{
+			this->shutdownCallback_ = callback;
+		}
+		return true;
+	}
+
+	// Do io of port without waiting: finish or start tx, read received data
+	// and call callbacks. Only for CALLER_POLL model.
+	// Return false if port is closed or was shutdown.
+	template <bool IsThreaded = IS_THREADED>
+	bool poll()
+	{
+		static_assert(!IsThreaded, "poll() is only for ThreadingModel::CALLER_POLL");
+		if (!this->isOpen_)
+		{
+			return false;
+		}
+		if (!this->pollTx() || !this->pollRx())
+		{
+			this->shutdown();
+			return false;
+		}
+		return true;
+	}
+
+protected:
+	HANDLE						hComPort_;
+	OVERLAPPED					hRxOverlapped_;
+	OVERLAPPED					hTxOverlapped_;
+	std::atomic<bool>			isOpen_;
+	std::atomic<uint32_t>		openCount_;
+
+	uint8_t						portNum_;
+	Baudrate					baudrate_;
+	WordLength					wordLength_;
+	StopBits					stopBits_;
+	Parity						parity_;
+
+	detail::StaticRing<Config::RX_QUEUE_SIZE>	rxQueue_;
+	Lock						queueLock_; // Lock of rx and tx fifo.
+
+	Callback					rxDataCallback_;
+	Callback					txDataCallback_;
+	Callback					shutdownCallback_;
+
+	void callCallback(Callback& callback)
+	{
+		if (callback)
+		{
+			callback();
+		}
+	}
+
+	void shutdown()
+	{
+		this->callCallback(this->shutdownCallback_);
+	}
+
+private:
+	using Port = typename std::conditional<std::is_void<Derived>::value,
+										   BasicComPort, Derived>::type;
+
+	detail::StaticRing<Config::TX_QUEUE_SIZE>	txQueue_;
+	// Positions of ends of txData() calls. Every call has at least one byte
+	// in tx fifo, so size of tx fifo is enough.
+	detail::StaticRing<Config::TX_QUEUE_SIZE, uint32_t>	txCallEnds_;
+	uint32_t					txPushCount_; // Count of data put into tx fifo.
+	uint32_t					txWriteCount_; // Count of data written to port.
+	bool						isTxPending_; // Write of txPendingCount_ data is not complete.
+	size_t						txPendingCount_;
+
+	detail::ThreadingFields<Config::THREADING>	threading_;
+
+	// Port, which hooks are called.
+	Port& port()
+	{
+		return static_cast<Port&>(*this);
+	}
+
+	// Set timeouts and create events of io. Port handle is already opened.
+	Result initIo()
+	{
+		// Threads wait first byte up to 100 ms (to check close), poll() never waits.
+		// Then read return at once with data of driver queue.
+		COMMTIMEOUTS timeouts;
+		std::memset(&timeouts, 0, sizeof(timeouts));
+		timeouts.ReadIntervalTimeout = MAXDWORD;
+		if (IS_THREADED)
+		{
+			timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+			timeouts.ReadTotalTimeoutConstant = 100;
+		}
+		if (!SetCommTimeouts(this->hComPort_, &timeouts))
+		{
+			return Result::ERROR_SET_PORT_CONFIG;
+		}
+		this->hRxOverlapped_.hEvent = CreateEvent(nullptr, true, false, nullptr);
+		if (this->hRxOverlapped_.hEvent == nullptr)
+		{
+			return Result::ERROR_INIT_RX_EVENT;
+		}
+		this->hTxOverlapped_.hEvent = CreateEvent(nullptr, true, false, nullptr);
+		if (this->hTxOverlapped_.hEvent == nullptr)
+		{
+			return Result::ERROR_INIT_TX_EVENT;
+		}
+		return Result::SUCCESS;
+	}
+
+	// Free resources of initIo(), besides port handle and rx/tx events.
+	void closeIo()
+	{
+	}
+
+	// Methods, which use threads, are templates with tag std::true_type, so
+	// they are compiled only for INTERNAL_THREADS, also by explicit instantiation.
+	Result startThreads(std::false_type)
+	{
+		return Result::SUCCESS;
+	}
+
+	template <class ThreadedTag>
+	Result startThreads(ThreadedTag)
+	{
+		this->threading_.rxThread = std::thread(&BasicComPort::doRxData, this);
+		this->threading_.txThread = std::thread(&BasicComPort::doTxData<ThreadedTag>, this);
+		return Result::SUCCESS;
+	}
+
+	void stopThreads(std::false_type)
+	{
+	}
+
+	template <class ThreadedTag>
+	void stopThreads(ThreadedTag)
+	{
+		// Break io of threads, they check close after it.
+		if (this->hComPort_ != nullptr)
+		{
+			CancelIoEx(this->hComPort_, nullptr);
+		}
+		if (this->threading_.txThread.joinable())
+		{
+			{
+				std::lock_guard<Lock> lock(this->queueLock_);
+				this->threading_.releaseTxThread.notify_one();
+			}
+			this->threading_.txThread.join();
+		}
+		if (this->threading_.rxThread.joinable())
+		{
+			this->threading_.rxThread.join();
+		}
+	}
+
+	void releaseTxThread(std::false_type)
+	{
+	}
+
+	template <class ThreadedTag>
+	void releaseTxThread(ThreadedTag)
+	{
+		this->threading_.releaseTxThread.notify_one();
+	}
+
+	// Read received data into rx fifo. Return false on error.
+	bool readRxData(bool& isRxData)
+	{
+		std::unique_lock<Lock> lock(this->queueLock_);
+		size_t freeCount;
+		uint8_t* part = this->rxQueue_.back(freeCount);
+		lock.unlock();
+
+		// Fifo is full, read into temporary buffer to drop data, like ComPort.
+		uint8_t dropBuffer[64];
+		if (freeCount == 0)
+		{
+			part = dropBuffer;
+			freeCount = sizeof(dropBuffer);
+		}
+
+		// Consumer doesn't touch free place, so it is filled without lock.
+		DWORD rxDataCnt = 0;
+		if (!ReadFile(this->hComPort_, part, static_cast<DWORD>(freeCount),
+					  &rxDataCnt, &this->hRxOverlapped_))
+		{
+			if (GetLastError() != ERROR_IO_PENDING ||
+				!GetOverlappedResult(this->hComPort_, &this->hRxOverlapped_, &rxDataCnt, true))
+			{
+				return false;
+			}
+		}
+		isRxData = (rxDataCnt != 0);
+		if (isRxData && part != dropBuffer)
+		{
+			lock.lock();
+			this->rxQueue_.commit(rxDataCnt);
+		}
+		return true;
+	}
+
+	bool pollRx()
+	{
+		bool isRxData = false;
+		if (!this->readRxData(isRxData))
+		{
+			return false;
+		}
+		if (isRxData)
+		{
+			this->callCallback(this->rxDataCallback_);
+		}
+		return true;
+	}
+
+	bool pollTx()
+	{
+		DWORD txDataCnt;
+		if (this->isTxPending_)
+		{
+			if (!GetOverlappedResult(this->hComPort_, &this->hTxOverlapped_, &txDataCnt, false))
+			{
+				return GetLastError() == ERROR_IO_INCOMPLETE;
+			}
+			this->isTxPending_ = false;
+			if (!this->completeTx(txDataCnt))
+			{
+				return false;
+			}
+		}
+
+		std::unique_lock<Lock> lock(this->queueLock_);
+		size_t count;
+		const uint8_t* part = this->txQueue_.front(count);
+		lock.unlock();
+		if (count == 0)
+		{
+			return true;
+		}
+
+		// Data is removed from fifo only after write, so producer doesn't touch it.
+		this->txPendingCount_ = count;
+		if (!WriteFile(this->hComPort_, part, static_cast<DWORD>(count), &txDataCnt,
+					   &this->hTxOverlapped_))
+		{
+			if (GetLastError() != ERROR_IO_PENDING)
+			{
+				return false;
+			}
+			this->isTxPending_ = true;
+			return true;
+		}
+		return this->completeTx(txDataCnt);
+	}
+
+	// Remove written data from tx fifo and call TX_DATA for every txData()
+	// call, which data is written now. Return false if not all data was written.
+	bool completeTx(DWORD txDataCnt)
+	{
+		if (txDataCnt != this->txPendingCount_)
+		{
+			return false;
+		}
+		std::unique_lock<Lock> lock(this->queueLock_);
+		this->txQueue_.drop(txDataCnt);
+		this->txWriteCount_ += txDataCnt;
+		size_t endCount = 0, partCount;
+		while (this->txCallEnds_.size() != 0)
+		{
+			const uint32_t* callEnd = this->txCallEnds_.front(partCount);
+			if (static_cast<int32_t>(this->txWriteCount_ - *callEnd) < 0)
+			{
+				break;
+			}
+			this->txCallEnds_.drop(1);
+			endCount++;
+		}
+		lock.unlock();
+		for (; endCount != 0; endCount--)
+		{
+			this->callCallback(this->txDataCallback_);
+		}
+		return true;
+	}
+
+	// Method for rx data in other thread.
+	void doRxData()
+	{
+		bool isRxData;
+		while (this->isOpen_)
+		{
+			isRxData = false;
+			if (!this->readRxData(isRxData))
+			{
+				if (this->isOpen_)
+				{
+					this->shutdown();
+				}
+				return;
+			}
+			if (isRxData)
+			{
+				this->callCallback(this->rxDataCallback_);
+			}
+		}
+	}
+
+	// Method for tx data in other thread.
+	template <class ThreadedTag>
+	void doTxData()
+	{
+		std::unique_lock<Lock> lock(this->queueLock_, std::defer_lock);
+		while (true)
+		{
+			// Close is checked under lock, else its notify can come between
+			// check and wait and the thread never wakes up.
+			lock.lock();
+			this->threading_.releaseTxThread.wait(lock, [this]()
+			{
+				return !this->isOpen_ || this->txQueue_.size() != 0;
+			});
+			if (!this->isOpen_)
+			{
+				return;
+			}
+			size_t count;
+			const uint8_t* part = this->txQueue_.front(count);
+			lock.unlock();
+
+			DWORD txDataCnt;
+			this->txPendingCount_ = count;
+			if (!WriteFile(this->hComPort_, part, static_cast<DWORD>(count), &txDataCnt,
+						   &this->hTxOverlapped_))
+			{
+				if (GetLastError() != ERROR_IO_PENDING ||
+					!GetOverlappedResult(this->hComPort_, &this->hTxOverlapped_, &txDataCnt, true))
+				{
+					txDataCnt = 0;
+				}
+			}
+			if (!this->completeTx(txDataCnt))
+			{
+				if (this->isOpen_)
+				{
+					this->shutdown();
+				}
+				return;
+			}
+		}
+	}
+};
+
+template <class Config, class Derived>
+const bool BasicComPort<Config, Derived>::IS_THREADED;
+
+// Port with own threads, analog of ComPort without its extra features.
+using ThreadedComPort = BasicComPort<ThreadedComPortConfig>;
+
+// Port for single-threaded event loop, driven by poll().
+using PolledComPort = BasicComPort<PolledComPortConfig>;
+
+// They are compiled in BasicComPort.cpp.
+extern template class BasicComPort<ThreadedComPortConfig>;
+extern template class BasicComPort<PolledComPortConfig>;
+
+} // kylsocomport
@@ -1,25 +1,38 @@
 #include "ComPort.h"
+#include "ComPortTrace.h"
 #include <string>
 #include <thread>
 #include <algorithm>
 #include <chrono>
+#include <malloc.h>
 
 namespace kylsocomport
 {
 
 ComPort::ComPort(uint8_t portNum, Baudrate baudrate, WordLength wordLength,
 				 StopBits stopBits, Parity parity) :
-	portNum_(portNum), baudrate_(baudrate), wordLength_(wordLength),
-	stopBits_(stopBits), parity_(parity)
+	BasicComPort(portNum, baudrate, wordLength, stopBits, parity),
+	linkCodec_(64), rxBroadcast_(4096)
 {
-	this->hComPort_ = nullptr;
-    std::memset(&(this->dcbComPortParams_), 0, sizeof(this->dcbComPortParams_));
-    std::memset(&(this->hRxOverlapped_), 0, sizeof(this->hRxOverlapped_));
-	this->isOpen_ = false;
-	this->rxQueueSize_ = 512;
+	std::memset(&(this->hRxWaitOverlapped_), 0, sizeof(this->hRxWaitOverlapped_));
+	this->isCompression_ = false;
+	this->rxMode_ = RxMode::EVENT;
+	this->isRxStatsEnable_ = false;
+	this->isRxWakeupPending_ = false;
+	this->byteTimeNs_ = 0;
 	this->txDataQueueSize_ = 512;
-	this->txDataQueueUse_ = 0;
+	this->txDataQueueUse_.fill(0);
 	this->txOverlappedQueueSize_ = 5;
+	this->txScheduling_ = TxScheduling::STRICT_PRIORITY;
+	this->txLaneWeights_ = {8, 4, 2, 1};
+	this->txLatencyBudgetUs_ = 0;
+	this->txPartSize_ = 0;
+	this->isReleaseTxDataThread_ = false;
+
+	// Core has one callback per event, it calls all subscribers.
+	this->setCallback(Event::RX_DATA, [this]() { this->callSubscribers(this->rxDataCallbacks_); });
+	this->setCallback(Event::TX_DATA, [this]() { this->callSubscribers(this->txDataCallbacks_); });
+	this->setCallback(Event::SHUTDOWN, [this]() { this->callSubscribers(this->shutdownCallbacks_); });
 }
 
 ComPort::~ComPort()
@@ -27,115 +40,187 @@ ComPort::~ComPort()
     this->close();
 }
 
-ComPort::Result ComPort::open()
+ComPort::Result ComPort::initIo()
 {
-	if (this->isOpen_)
-	{
-		return Result::ERROR_ALREADY_OPEN;
-	}
-	std::string portName = "\\\\.\\COM";
-	if (this->portNum_ == 0)
+    std::memset(&(this->hRxOverlapped_), 0, sizeof(this->hRxOverlapped_));
+	this->hRxOverlapped_.hEvent = CreateEvent(nullptr, true, false, TEXT("UART RX DATA EVENT"));
+	if (this->hRxOverlapped_.hEvent == nullptr)
 	{
-		return Result::ERROR_BAD_PORT_NUM;
+		return Result::ERROR_INIT_RX_EVENT;
 	}
-	portName += std::to_string(this->portNum_);
-	this->hComPort_ = CreateFile(portName.c_str(), GENERIC_READ | GENERIC_WRITE,
-								 0, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
-	if (this->hComPort_ == INVALID_HANDLE_VALUE)
+	if (this->rxMode_ == RxMode::POLL)
 	{
-		this->close();
-		return Result::ERROR_OPEN;
+		// Read return at once with data of driver queue or with nothing.
+		COMMTIMEOUTS timeouts;
+		std::memset(&timeouts, 0, sizeof(timeouts));
+		timeouts.ReadIntervalTimeout = MAXDWORD;
+		if (!SetCommTimeouts(this->hComPort_, &timeouts) ||
+			!SetCommMask(this->hComPort_, EV_RXCHAR))
+		{
+			return Result::ERROR_SET_PORT_CONFIG;
+		}
+		std::memset(&(this->hRxWaitOverlapped_), 0, sizeof(this->hRxWaitOverlapped_));
+		this->hRxWaitOverlapped_.hEvent = CreateEvent(nullptr, true, false, nullptr);
+		if (this->hRxWaitOverlapped_.hEvent == nullptr)
+		{
+			return Result::ERROR_INIT_RX_EVENT;
+		}
 	}
-	std::memset(&(this->dcbComPortParams_), 0, sizeof(this->dcbComPortParams_));
-	this->dcbComPortParams_.DCBlength = sizeof(this->dcbComPortParams_);
-	if (!GetCommState(this->hComPort_, &(this->dcbComPortParams_)))
+
+	this->byteTimeNs_ = getByteTimeNs(this->baudrate_, this->wordLength_,
+									  this->stopBits_, this->parity_);
+	if (this->txLatencyBudgetUs_ != 0)
 	{
-		this->close();
-		return Result::ERROR_SET_PORT_CONFIG;
+		this->txPartSize_ = std::max<uint32_t>(1, static_cast<uint32_t>(
+			1000ull * this->txLatencyBudgetUs_ / this->byteTimeNs_));
 	}
-	this->dcbComPortParams_.BaudRate = static_cast<DWORD>(this->baudrate_);
-	this->dcbComPortParams_.ByteSize = static_cast<BYTE>(this->wordLength_);
-	this->dcbComPortParams_.StopBits = static_cast<BYTE>(this->stopBits_);
-	this->dcbComPortParams_.Parity = static_cast<BYTE>(this->parity_);
-	if (!SetCommState(this->hComPort_, &(this->dcbComPortParams_)))
+	else
 	{
-		this->close();
-		return Result::ERROR_SET_PORT_CONFIG;
+		this->txPartSize_ = 0;
 	}
-    std::memset(&(this->hRxOverlapped_), 0, sizeof(this->hRxOverlapped_));
-	this->hRxOverlapped_.hEvent = CreateEvent(nullptr, true, false, TEXT("UART RX DATA EVENT"));
-	if (this->hRxOverlapped_.hEvent == nullptr)
+	this->resetRxStats();
+	this->rxBroadcast_.start();
+	this->linkCodec_.resetDecoder();
+	this->linkCodec_.resetStats();
+	return Result::SUCCESS;
+}
+
+void ComPort::closeIo()
+{
+	if (this->hRxWaitOverlapped_.hEvent != nullptr) CloseHandle(this->hRxWaitOverlapped_.hEvent);
+	this->hRxWaitOverlapped_.hEvent = nullptr;
+
+	// Clear queue.
+    std::lock_guard<std::mutex> txLock(this->txQueueMutex_);
+	for (auto& txQueue : this->txQueues_)
 	{
-		this->close();
-		return Result::ERROR_INIT_RX_EVENT;
+		// Event of overlapped isn't owned by unique_ptr, so close it.
+		for (; !txQueue.empty(); txQueue.pop())
+		{
+			CloseHandle(txQueue.front().first->hEvent);
+		}
 	}
-	this->isOpen_ = true;
+	this->txDataQueueUse_.fill(0);
+}
+
+ComPort::Result ComPort::startThreads(std::true_type)
+{
     this->isReleaseTxDataThread_ = false;
+    std::promise<bool> rxThreadStartEventHandler;
+    auto rxThreadStartEvent = rxThreadStartEventHandler.get_future();
     std::promise<void> rxThreadEndEventHandler;
     this->rxThreadEndEvent_ = rxThreadEndEventHandler.get_future();
-    std::thread rxDataThread(&ComPort::doRxData, this, std::move(rxThreadEndEventHandler));
+    std::thread rxDataThread(&ComPort::doRxData, this, std::move(rxThreadStartEventHandler),
+                             std::move(rxThreadEndEventHandler));
     rxDataThread.detach();
+    std::promise<bool> txThreadStartEventHandler;
+    auto txThreadStartEvent = txThreadStartEventHandler.get_future();
     std::promise<void> txThreadEndEventHandler;
     this->txThreadEndEvent_ = txThreadEndEventHandler.get_future();
-    std::thread txDataThread(&ComPort::doTxData, this, std::move(txThreadEndEventHandler));
+    std::thread txDataThread(&ComPort::doTxData, this, std::move(txThreadStartEventHandler),
+                             std::move(txThreadEndEventHandler));
 	txDataThread.detach();
+
+	// Wait while threads apply own settings.
+	bool isRxThreadStart = rxThreadStartEvent.get();
+	bool isTxThreadStart = txThreadStartEvent.get();
+	if (!isRxThreadStart || !isTxThreadStart)
+	{
+		return Result::ERROR_SET_THREAD_CONFIG;
+	}
 	return Result::SUCCESS;
 }
 
-void ComPort::close()
+void ComPort::stopThreads(std::true_type)
 {
-	// Close port.
-	this->isOpen_ = false;
-	if (this->hComPort_ != nullptr) CloseHandle(this->hComPort_);
-	if (this->hRxOverlapped_.hEvent != nullptr) CloseHandle(this->hRxOverlapped_.hEvent);
-	this->hComPort_ = nullptr;
-	this->hRxOverlapped_.hEvent = nullptr;
+	this->rxBroadcast_.shutdown(); // Rx thread can wait slow subscribers.
 
-	// Clear queue.
-    std::unique_lock<std::mutex> rxLock(this->rxQueueMutex_);
-    std::unique_lock<std::mutex> txLock(this->txQueueMutex_);
-	std::queue<uint8_t> emptyRxQueue;
-	std::queue<TxQueueElement> emptyTxQueue;
-	this->rxQueue_.swap(emptyRxQueue);
-	this->txQueue_.swap(emptyTxQueue);
-    rxLock.unlock();
-    txLock.unlock();
-    if (!this->isReleaseTxDataThread_)
-    {
-        std::unique_lock<std::mutex> threadWorkLock(this->txDataThreadMutex_);
-        this->releaseTxDataThreadWork_.notify_one();
-    }
-    this->isReleaseTxDataThread_ = false;
-
-    if (this->rxThreadEndEvent_.valid())
-    {
-        this->rxThreadEndEvent_.wait_for(std::chrono::seconds(1));
-    }
-    if (this->txThreadEndEvent_.valid())
-    {
-        this->txThreadEndEvent_.wait_for(std::chrono::seconds(1));
-    }
+	// Break io and wait of threads, they check close after it. Io or wait
+	// started after it isn't broken, so it's repeated while threads work.
+	auto isThreadEnd = [](std::future<void>& threadEndEvent, std::chrono::milliseconds time)
+	{
+		return !threadEndEvent.valid() ||
+			threadEndEvent.wait_for(time) == std::future_status::ready;
+	};
+	for (int i = 0; i < 100; i++)
+	{
+		CancelIoEx(this->hComPort_, nullptr);
+		std::unique_lock<std::mutex> threadWorkLock(this->txDataThreadMutex_);
+		this->releaseTxDataThreadWork_.notify_one();
+		threadWorkLock.unlock();
+		if (isThreadEnd(this->rxThreadEndEvent_, std::chrono::milliseconds(10)) &&
+			isThreadEnd(this->txThreadEndEvent_, std::chrono::milliseconds(0)))
+		{
+			break;
+		}
+	}
 }
 
 uint16_t ComPort::getRxDataCount()
 {
-	std::lock_guard<std::mutex> lock(this->rxQueueMutex_);
-	return static_cast<uint16_t>(this->rxQueue_.size());
+	return static_cast<uint16_t>(BasicComPort::getRxDataCount());
 }
 
 void ComPort::rxData(std::vector<uint8_t>& data, uint16_t count)
 {
-	std::lock_guard<std::mutex> lock(this->rxQueueMutex_);
-	while (!this->rxQueue_.empty() && count)
+	COMPORT_TRACE_BEGIN("rx queue lock");
+	std::lock_guard<std::mutex> lock(this->queueLock_);
+	COMPORT_TRACE_END("rx queue lock", 0);
+	size_t readCount = std::min<size_t>(count, this->rxQueue_.size());
+	COMPORT_TRACE_INSTANT("rx data", static_cast<uint32_t>(readCount));
+	for (size_t partCount; readCount != 0; readCount -= partCount)
+	{
+		const uint8_t* part = this->rxQueue_.front(partCount);
+		partCount = std::min<size_t>(partCount, readCount);
+		data.insert(data.end(), part, part + partCount);
+		this->rxQueue_.drop(partCount);
+	}
+}
+
+ComPort::RxStats ComPort::getRxStats()
+{
+	std::lock_guard<std::mutex> lock(this->rxStatsMutex_);
+	return this->rxStats_;
+}
+
+void ComPort::resetRxStats()
+{
+	std::lock_guard<std::mutex> lock(this->rxStatsMutex_);
+	this->rxStats_ = RxStats();
+}
+
+ComPort::CompressionStats ComPort::getCompressionStats()
+{
+	CompressionStats stats;
+	stats.codec = this->linkCodec_.getStats();
+	if (stats.codec.txWireBytes != 0)
+	{
+		stats.txRatio = static_cast<double>(stats.codec.txRawBytes) / stats.codec.txWireBytes;
+	}
+	if (this->byteTimeNs_ != 0)
 	{
-		data.push_back(this->rxQueue_.front());
-		this->rxQueue_.pop();
-		count--;
+		stats.txEffectiveRate = stats.txRatio * 1e9 / this->byteTimeNs_;
 	}
+	return stats;
 }
 
-ComPort::Result ComPort::txData(std::vector<uint8_t> data)
+ComPort::Result ComPort::txData(std::vector<uint8_t> data, TxPriority priority)
 {
+	// Replace data with its frame. It's done before lock, so compression
+	// doesn't stop tx thread and other callers.
+	size_t rawSize = data.size();
+	bool isCompressed = false;
+	if (this->isCompression_)
+	{
+		if (rawSize > LinkCodec::MAX_BLOCK_SIZE)
+		{
+			return Result::ERROR_TX_QUEUE_FULL; // Frame can't hold it.
+		}
+		std::vector<uint8_t> frame;
+		isCompressed = this->linkCodec_.encode(data, frame);
+		data = std::move(frame);
+	}
+
     std::lock_guard<std::mutex> txQueueLock(this->txQueueMutex_);
     std::unique_lock<std::mutex> threadWorkLock(this->txDataThreadMutex_);
 
@@ -144,11 +229,12 @@ ComPort::Result ComPort::txData(std::vector<uint8_t> data)
 		return Result::ERROR_PORT_CLOSE;
     }
 
-	// Check place for overlapped and data in fifo.
+	// Check place for overlapped and data in fifo of lane.
+	size_t lane = static_cast<size_t>(priority);
 	bool hasPlaceForData = static_cast<uint16_t>(data.size()) <
-		(this->txDataQueueSize_ - this->txDataQueueUse_);
+		(this->txDataQueueSize_ - this->txDataQueueUse_[lane]);
 
-    if ((this->txQueue_.size() == this->txOverlappedQueueSize_) ||
+    if ((this->txQueues_[lane].size() == this->txOverlappedQueueSize_) ||
 		(!hasPlaceForData))
 	{
 		return Result::ERROR_TX_QUEUE_FULL;
@@ -165,10 +251,17 @@ ComPort::Result ComPort::txData(std::vector<uint8_t> data)
 	}
 
 	// Add data to tx queue.
-    this->txDataQueueUse_ += static_cast<uint16_t>(data.size());
+    this->txDataQueueUse_[lane] += static_cast<uint16_t>(data.size());
     auto upTxOverlapped = std::unique_ptr<OVERLAPPED>{txOverlapped};
     TxQueueElement txQueueElement{std::move(upTxOverlapped), std::move(data)};
-    this->txQueue_.push(std::move(txQueueElement));
+    this->txQueues_[lane].push(std::move(txQueueElement));
+	if (this->isCompression_)
+	{
+		this->linkCodec_.countTxFrame(rawSize, this->txQueues_[lane].back().second.size(),
+									  isCompressed);
+	}
+
+	COMPORT_TRACE_INSTANT("tx queue", static_cast<uint32_t>(rawSize));
 
 	// Disable thread block if need.
     if (!this->isReleaseTxDataThread_)
@@ -182,38 +275,7 @@ ComPort::Result ComPort::txData(std::vector<uint8_t> data)
 
 std::string ComPort::getTextOfResult(Result result) const
 {
-    std::string sResult;
-    switch (result)
-    {
-        case Result::SUCCESS:
-            sResult = "success";
-            break;
-        case Result::ERROR_ALREADY_OPEN:
-            sResult = "comport already open";
-            break;
-        case Result::ERROR_BAD_PORT_NUM:
-            sResult = "bad comport num";
-            break;
-        case Result::ERROR_OPEN:
-            sResult = "cant open";
-            break;
-        case Result::ERROR_SET_PORT_CONFIG:
-            sResult = "cant set comport config";
-            break;
-        case Result::ERROR_INIT_RX_EVENT:
-            sResult = "cant initialize rx event";
-            break;
-        case Result::ERROR_PORT_CLOSE:
-            sResult = "comport is close";
-            break;
-        case Result::ERROR_TX_QUEUE_FULL:
-            sResult = "tx queue full";
-            break;
-        case Result::ERROR_INIT_TX_EVENT:
-            sResult = "cant initialize tx event";
-            break;
-    }
-    return sResult;
+    return kylsocomport::getTextOfResult(result);
 }
 
 void ComPort::setSubscribeOnEvent(Event event, UpCallback callback)
@@ -223,6 +285,10 @@ void ComPort::setSubscribeOnEvent(Event event, UpCallback callback)
 	{
 		callbacks = &this->rxDataCallbacks_;
 	}
+	else if (event == Event::TX_DATA)
+	{
+		callbacks = &this->txDataCallbacks_;
+	}
 	else // event == Event::SHUTDOWN
 	{
 		callbacks = &this->shutdownCallbacks_;
@@ -234,6 +300,7 @@ void ComPort::setSubscribeOnEvent(Event event, UpCallback callback)
         if (i.get() == callback.get())
         {
             this->callbackMutex_.unlock();
+            callback.release(); // Object is owned by stored pointer.
             return; // This callback already set.
         }
     }
@@ -249,10 +316,14 @@ void ComPort::resetSubscribeOnEvent(Event event, UpCallback callback)
 	{
 		callbacks = &this->rxDataCallbacks_;
 	}
+	else if (event == Event::TX_DATA)
+	{
+		callbacks = &this->txDataCallbacks_;
+	}
 	else // event == Event::SHUTDOWN
 	{
 		callbacks = &this->shutdownCallbacks_;
-    }
+	}
 
     this->callbackMutex_.lock();
     for (auto i = callbacks->begin(); i != callbacks->end(); ++i)
@@ -260,78 +331,355 @@ void ComPort::resetSubscribeOnEvent(Event event, UpCallback callback)
         if (i->get() == callback.get())
         {
             callbacks->erase(i); // This callback set.
+            callback.release(); // Object was deleted with stored pointer.
             break;
         }
     }
     this->callbackMutex_.unlock();
 }
 
-void ComPort::doRxData(std::promise<void> endEventHadler)
+bool ComPort::setProcessPriorityClass(PriorityClass priorityClass)
+{
+	return SetPriorityClass(GetCurrentProcess(), static_cast<DWORD>(priorityClass)) != 0;
+}
+
+bool ComPort::lockProcessMemory(size_t minSize, size_t maxSize)
+{
+	return SetProcessWorkingSetSizeEx(GetCurrentProcess(), minSize, maxSize,
+									  QUOTA_LIMITS_HARDWS_MIN_ENABLE) != 0;
+}
+
+bool ComPort::applyThreadConfig(const ThreadConfig& config)
+{
+	HANDLE hThread = GetCurrentThread();
+	if (config.affinityMask != 0)
+	{
+		if (SetThreadAffinityMask(hThread, config.affinityMask) == 0)
+		{
+			return false;
+		}
+	}
+	if (!SetThreadPriority(hThread, static_cast<int>(config.priority)))
+	{
+		return false;
+	}
+	if (!config.name.empty())
+	{
+		// SetThreadDescription exist only since Windows 10 1607, so it get dynamically.
+		using SetThreadDescriptionFunc = HRESULT (WINAPI*)(HANDLE, PCWSTR);
+		HMODULE hKernel = GetModuleHandleW(L"kernel32.dll");
+		if (hKernel != nullptr)
+		{
+			auto setThreadDescription = reinterpret_cast<SetThreadDescriptionFunc>(
+				GetProcAddress(hKernel, "SetThreadDescription"));
+			if (setThreadDescription != nullptr)
+			{
+				setThreadDescription(hThread, config.name.c_str());
+			}
+		}
+	}
+	if (config.lockedStackSize != 0)
+	{
+		// Touch every page of stack below current frame (from top to bottom,
+		// as stack grows), so page faults happen now and not in time of work,
+		// then lock these pages. Size is checked with free stack of thread,
+		// else _alloca raises stack overflow instead of return error.
+		ULONG_PTR stackLow, stackHigh;
+		GetCurrentThreadStackLimits(&stackLow, &stackHigh);
+		ULONG_PTR stackFree = reinterpret_cast<ULONG_PTR>(&stackLow) - stackLow;
+		if (config.lockedStackSize + LOCKED_STACK_RESERVE > stackFree)
+		{
+			return false;
+		}
+		volatile uint8_t* stack = static_cast<volatile uint8_t*>(_alloca(config.lockedStackSize));
+		for (size_t i = config.lockedStackSize; i > 0; i -= std::min<size_t>(i, 4096))
+		{
+			stack[i - 1] = 0;
+		}
+		if (!VirtualLock(const_cast<uint8_t*>(stack), config.lockedStackSize))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void ComPort::doRxData(std::promise<bool> startEventHandler, std::promise<void> endEventHadler)
+{
+	if (!applyThreadConfig(this->rxThreadConfig_))
+	{
+		startEventHandler.set_value(false);
+		endEventHadler.set_value();
+		return;
+	}
+	startEventHandler.set_value(true);
+	COMPORT_TRACE_THREAD_NAME("ComPort rx");
+
+	bool isShutdown;
+	if (this->rxMode_ == RxMode::POLL)
+	{
+		isShutdown = this->doRxPollLoop();
+	}
+	else // this->rxMode_ == RxMode::EVENT
+	{
+		isShutdown = this->doRxEventLoop();
+	}
+	if (isShutdown && this->isOpen_)
+	{
+		this->shutdown();
+	}
+    endEventHadler.set_value();
+}
+
+bool ComPort::doRxEventLoop()
 {
 	uint8_t byte;
 	DWORD rxDataCnt;
-	std::unique_lock<std::mutex> rxQueueLock(this->rxQueueMutex_, std::defer_lock);
-	bool isShutdown = false, isRxByte = false;
 	while (this->isOpen_)
 	{
 		if (!ReadFile(this->hComPort_, &byte, 1, &rxDataCnt, &this->hRxOverlapped_))
 		{
 			if (GetLastError() != ERROR_IO_PENDING)
 			{
-				isShutdown = true;
-                break;
+				return true;
 			}
-			if (WaitForSingleObject(this->hRxOverlapped_.hEvent, INFINITE) == WAIT_OBJECT_0)
+			COMPORT_TRACE_BEGIN("rx wait");
+			DWORD waitResult = WaitForSingleObject(this->hRxOverlapped_.hEvent, INFINITE);
+			COMPORT_TRACE_END("rx wait", 0);
+			this->markRxWakeup();
+			if (waitResult != WAIT_OBJECT_0)
 			{
-				if (!GetOverlappedResult(this->hComPort_, &this->hRxOverlapped_,
-                                         &rxDataCnt, false))
-				{
-					isShutdown = true;
-					break;
-				}
-				isRxByte = true;
+				return true;
 			}
-			else
+			if (!GetOverlappedResult(this->hComPort_, &this->hRxOverlapped_,
+									 &rxDataCnt, false))
 			{
-				isShutdown = true;
-                break;
+				return true;
 			}
+			this->updateRxStats(rxDataCnt, RxStage::BLOCK, false);
 		}
 		else
 		{
-			isRxByte = true;			
+			this->updateRxStats(rxDataCnt, RxStage::CONTINUOUS, false);
 		}
-		if (isRxByte)
+		this->onRxData(&byte, rxDataCnt);
+	}
+	return false;
+}
+
+bool ComPort::doRxPollLoop()
+{
+	uint8_t buffer[256];
+	DWORD rxDataCnt, commEvent;
+	uint32_t idleCount = 0;
+	RxStage stage = RxStage::CONTINUOUS;
+	const uint32_t spinLimit = this->pollConfig_.spinCount;
+	const uint32_t yieldLimit = spinLimit + this->pollConfig_.yieldCount;
+	while (this->isOpen_)
+	{
+		if (stage == RxStage::SPIN || stage == RxStage::YIELD)
+		{
+			this->markRxWakeup();
+		}
+		// Read timeouts set in open(), so read complete at once with
+		// all data of driver queue or with nothing.
+		if (!ReadFile(this->hComPort_, buffer, sizeof(buffer), &rxDataCnt, &this->hRxOverlapped_))
 		{
-			isRxByte = false;
-			rxQueueLock.lock();
-			if (this->rxQueue_.size() != this->rxQueueSize_)
+			if (GetLastError() != ERROR_IO_PENDING)
 			{
-				this->rxQueue_.push(byte);
-            }
-            rxQueueLock.unlock();
-            this->callbackMutex_.lock();
-            for (auto& callback : this->rxDataCallbacks_)
+				return true;
+			}
+			if (!GetOverlappedResult(this->hComPort_, &this->hRxOverlapped_,
+									 &rxDataCnt, true))
 			{
-                (*(callback.get()))();
+				return true;
+			}
+		}
+		if (rxDataCnt > 0)
+		{
+			this->updateRxStats(rxDataCnt, stage, rxDataCnt < sizeof(buffer));
+			this->onRxData(buffer, rxDataCnt);
+			idleCount = 0;
+			stage = RxStage::CONTINUOUS;
+			continue;
+		}
+
+		// No data, do backoff: spin -> yield -> block.
+		idleCount++;
+		if (idleCount <= spinLimit)
+		{
+			YieldProcessor();
+			stage = RxStage::SPIN;
+		}
+		else if (idleCount <= yieldLimit)
+		{
+			SwitchToThread();
+			stage = RxStage::YIELD;
+		}
+		else
+		{
+			stage = RxStage::BLOCK;
+			if (!WaitCommEvent(this->hComPort_, &commEvent, &this->hRxWaitOverlapped_))
+			{
+				if (GetLastError() != ERROR_IO_PENDING)
+				{
+					return true;
+				}
+				COMPORT_TRACE_BEGIN("rx wait");
+				auto waitResult = WaitForSingleObject(this->hRxWaitOverlapped_.hEvent,
+													  this->pollConfig_.blockTimeoutMs);
+				COMPORT_TRACE_END("rx wait", 0);
+				this->markRxWakeup();
+				if (waitResult == WAIT_TIMEOUT)
+				{
+					// Cancel wait and get its result, then read again.
+					CancelIo(this->hComPort_);
+					GetOverlappedResult(this->hComPort_, &this->hRxWaitOverlapped_,
+										&rxDataCnt, true);
+				}
+				else if (waitResult != WAIT_OBJECT_0 ||
+						 !GetOverlappedResult(this->hComPort_, &this->hRxWaitOverlapped_,
+											  &rxDataCnt, false))
+				{
+					return true;
+				}
 			}
-            this->callbackMutex_.unlock();
 		}
 	}
-	if (isShutdown)
+	return false;
+}
+
+void ComPort::onRxData(const uint8_t* data, DWORD count)
+{
+	if (!this->isCompression_)
 	{
-        this->callbackMutex_.lock();
-        for (auto& callback : this->shutdownCallbacks_)
-        {
-            (*(callback.get()))();
-        }
-        this->callbackMutex_.unlock();
+		this->putRxData(data, count);
+		this->isRxWakeupPending_ = false;
+		return;
 	}
-    endEventHadler.set_value();
+
+	// Replace received data with data of complete frames. One read can hold
+	// several frames, so data is put by parts not greater than capacity of rx
+	// broadcast. Else its blocking subscriber, which reads in rx callback,
+	// can't get place.
+	this->rxDecodeBuffer_.clear();
+	this->linkCodec_.decode(data, count, this->rxDecodeBuffer_);
+	size_t partSize = std::max<size_t>(1, std::min<size_t>(LinkCodec::MAX_BLOCK_SIZE,
+														   this->rxBroadcast_.getCapacity()));
+	for (size_t offset = 0; offset < this->rxDecodeBuffer_.size(); offset += partSize)
+	{
+		this->putRxData(this->rxDecodeBuffer_.data() + offset, static_cast<DWORD>(
+			std::min<size_t>(partSize, this->rxDecodeBuffer_.size() - offset)));
+	}
+	this->isRxWakeupPending_ = false; // Read got only part of frame.
+}
+
+void ComPort::putRxData(const uint8_t* data, DWORD count)
+{
+	COMPORT_TRACE_INSTANT("rx read", count);
+	COMPORT_TRACE_BEGIN("rx queue lock");
+	std::unique_lock<std::mutex> rxQueueLock(this->queueLock_);
+	COMPORT_TRACE_END("rx queue lock", 0);
+	this->rxQueue_.push(data, count); // Data, which has no place, is dropped.
+	rxQueueLock.unlock();
+	this->measureRxWakeup();
+	this->rxBroadcast_.write(data, count);
+	COMPORT_TRACE_BEGIN("rx callbacks");
+	this->callCallback(this->rxDataCallback_);
+	COMPORT_TRACE_END("rx callbacks", count);
+}
+
+void ComPort::callSubscribers(std::vector<UpCallback>& callbacks)
+{
+	COMPORT_TRACE_BEGIN("callback lock");
+	std::lock_guard<std::mutex> lock(this->callbackMutex_);
+	COMPORT_TRACE_END("callback lock", 0);
+	for (auto& callback : callbacks)
+	{
+		(*(callback.get()))();
+	}
+}
+
+void ComPort::updateRxStats(DWORD count, RxStage stage, bool isDrained)
+{
+	if (!this->isRxStatsEnable_)
+	{
+		return;
+	}
+
+	uint64_t ageNs = 0;
+	if (stage != RxStage::CONTINUOUS)
+	{
+		DWORD pendingCount = 0;
+		if (!isDrained)
+		{
+			DWORD errors;
+			COMSTAT comStat;
+			if (ClearCommError(this->hComPort_, &errors, &comStat))
+			{
+				pendingCount = comStat.cbInQue;
+			}
+		}
+		ageNs = static_cast<uint64_t>(count + pendingCount - 1) * this->byteTimeNs_;
+	}
+
+	std::lock_guard<std::mutex> lock(this->rxStatsMutex_);
+	this->rxStats_.chunkCount++;
+	this->rxStats_.byteCount += count;
+	switch (stage)
+	{
+		case RxStage::CONTINUOUS:
+			return;
+		case RxStage::SPIN:
+			this->rxStats_.spinWakeups++;
+			break;
+		case RxStage::YIELD:
+			this->rxStats_.yieldWakeups++;
+			break;
+		case RxStage::BLOCK:
+			this->rxStats_.blockWakeups++;
+			break;
+	}
+	this->rxStats_.totalEstimatedAgeNs += ageNs;
+	this->rxStats_.maxEstimatedAgeNs = std::max<uint64_t>(this->rxStats_.maxEstimatedAgeNs, ageNs);
+}
+
+void ComPort::markRxWakeup()
+{
+	if (this->isRxStatsEnable_)
+	{
+		this->rxWakeupTime_ = std::chrono::steady_clock::now();
+		this->isRxWakeupPending_ = true;
+	}
+}
+
+void ComPort::measureRxWakeup()
+{
+	if (!this->isRxWakeupPending_)
+	{
+		return;
+	}
+	this->isRxWakeupPending_ = false;
+	uint64_t latencyNs = static_cast<uint64_t>(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - this->rxWakeupTime_).count());
+	std::lock_guard<std::mutex> lock(this->rxStatsMutex_);
+	this->rxStats_.measuredWakeups++;
+	this->rxStats_.totalWakeupLatencyNs += latencyNs;
+	this->rxStats_.maxWakeupLatencyNs = std::max<uint64_t>(this->rxStats_.maxWakeupLatencyNs, latencyNs);
 }
 
-void ComPort::doTxData(std::promise<void> endEventHadler)
+void ComPort::doTxData(std::promise<bool> startEventHandler, std::promise<void> endEventHadler)
 {
+	if (!applyThreadConfig(this->txThreadConfig_))
+	{
+		startEventHandler.set_value(false);
+		endEventHadler.set_value();
+		return;
+	}
+	startEventHandler.set_value(true);
+	COMPORT_TRACE_THREAD_NAME("ComPort tx");
+
     std::unique_lock<std::mutex>    txQueueLock(this->txQueueMutex_,
                                                 std::defer_lock);
 
@@ -339,40 +687,76 @@ void ComPort::doTxData(std::promise<void> endEventHadler)
                                                    std::defer_lock);
 
     bool                            isShutdown = false;
-    std::vector<uint8_t>            data;
     DWORD                           txDataCnt;
-    std::unique_ptr<OVERLAPPED>     txOverlapped;
+
+    // Elements in work of every lane and count of their sent data.
+    TxQueueElement                  txElements[TX_LANE_COUNT];
+    size_t                          txOffsets[TX_LANE_COUNT] = {};
+    bool                            hasLaneData[TX_LANE_COUNT] = {};
+    int32_t                         laneWeights[TX_LANE_COUNT] = {};
+
+    // Timer for wait of driver tx queue, Sleep() has resolution of timer tick.
+    HANDLE                          hTxTimer = nullptr;
+    if (this->txPartSize_ != 0)
+    {
+        hTxTimer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                          TIMER_ALL_ACCESS);
+        if (hTxTimer == nullptr)
+        {
+            hTxTimer = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+        }
+    }
 
 	while (this->isOpen_)
     {
         threadWorkLock.lock();
         if (!this->isReleaseTxDataThread_)
         {
+            COMPORT_TRACE_BEGIN("tx wait");
             this->releaseTxDataThreadWork_.wait(threadWorkLock);            
+            COMPORT_TRACE_END("tx wait", 0);
         }
         this->isReleaseTxDataThread_ = false;
         threadWorkLock.unlock();
 
+        // Take next element of lanes, which have no element in work.
         txQueueLock.lock();
-        if (this->txQueue_.size() > 0)
+        for (size_t lane = 0; lane < TX_LANE_COUNT; lane++)
         {
-            txOverlapped = std::move(this->txQueue_.front().first);
-            data = std::move(this->txQueue_.front().second);
-            this->txDataQueueUse_ -= static_cast<uint16_t>(data.size());
-            this->txQueue_.pop();
-            txQueueLock.unlock();
+            auto& txQueue = this->txQueues_[lane];
+            if (!txElements[lane].first && !txQueue.empty())
+            {
+                txElements[lane] = std::move(txQueue.front());
+                txOffsets[lane] = 0;
+                this->txDataQueueUse_[lane] -= static_cast<uint16_t>(txElements[lane].second.size());
+                txQueue.pop();
+            }
+            hasLaneData[lane] = static_cast<bool>(txElements[lane].first);
         }
-        else
+        txQueueLock.unlock();
+
+        int lane = this->chooseTxLane(hasLaneData, laneWeights);
+        if (lane < 0)
         {
-            txQueueLock.unlock();
             continue;
         }
+        OVERLAPPED* txOverlapped = txElements[lane].first.get();
+        const std::vector<uint8_t>& data = txElements[lane].second;
+        size_t offset = txOffsets[lane];
+        size_t size = data.size() - offset;
+        if (this->txPartSize_ != 0)
+        {
+            size = std::min<size_t>(size, this->txPartSize_);
+            this->waitTxDriverQueue(size, hTxTimer);
+        }
 
-        if (!WriteFile(this->hComPort_, data.data(), static_cast<DWORD>(data.size()),
-                       &txDataCnt, txOverlapped.get()))
+        COMPORT_TRACE_BEGIN("tx write");
+        if (!WriteFile(this->hComPort_, data.data() + offset, static_cast<DWORD>(size),
+                       &txDataCnt, txOverlapped))
         {
             if (GetLastError() != ERROR_IO_PENDING)
             {
+                COMPORT_TRACE_END("tx write", 0);
                 isShutdown = true;
                 break;
             }
@@ -381,10 +765,10 @@ void ComPort::doTxData(std::promise<void> endEventHadler)
                                                   INFINITE);
             if (waitResult == WAIT_OBJECT_0)
             {
-                if (GetOverlappedResult(this->hComPort_, txOverlapped.get(),
+                if (GetOverlappedResult(this->hComPort_, txOverlapped,
                                         &txDataCnt, false))
                 {
-                    if (txDataCnt == data.size())
+                    if (txDataCnt == size)
                     {
                         isTxSuccessful = true;
                     }
@@ -392,28 +776,126 @@ void ComPort::doTxData(std::promise<void> endEventHadler)
             }
             if (!isTxSuccessful)
             {
+                COMPORT_TRACE_END("tx write", 0);
                 isShutdown = true;
                 break;
             }
         }
-        if (txDataCnt != data.size())
+        if (txDataCnt != size)
         {
+            COMPORT_TRACE_END("tx write", 0);
             isShutdown = true;
             break;
         }
 
-		if (isShutdown)
+        COMPORT_TRACE_END("tx write", static_cast<uint32_t>(size));
+
+        // Don't wait on next step, while some lane has data.
+        txOffsets[lane] += size;
+        bool isElementEnd = (txOffsets[lane] == data.size());
+        if (isElementEnd)
+        {
+            CloseHandle(txOverlapped->hEvent);
+            txElements[lane] = TxQueueElement{};
+        }
+        txQueueLock.lock();
+        bool hasData = false;
+        for (size_t i = 0; i < TX_LANE_COUNT; i++)
+        {
+            hasData = hasData || txElements[i].first || !this->txQueues_[i].empty();
+        }
+        if (hasData)
+        {
+            threadWorkLock.lock();
+            this->isReleaseTxDataThread_ = true;
+            threadWorkLock.unlock();
+        }
+        txQueueLock.unlock();
+
+        if (isElementEnd)
+        {
+            COMPORT_TRACE_BEGIN("tx callbacks");
+            this->callCallback(this->txDataCallback_);
+            COMPORT_TRACE_END("tx callbacks", 0);
+        }
+	}
+	if (isShutdown && this->isOpen_)
+	{
+		this->shutdown();
+	}
+    for (auto& txElement : txElements)
+    {
+        if (txElement.first)
+        {
+            CloseHandle(txElement.first->hEvent);
+        }
+    }
+    if (hTxTimer != nullptr)
+    {
+        CloseHandle(hTxTimer);
+    }
+    endEventHadler.set_value();
+}
+
+int ComPort::chooseTxLane(const bool* hasLaneData, int32_t* laneWeights) const
+{
+	int lane = -1;
+	if (this->txScheduling_ == TxScheduling::STRICT_PRIORITY)
+	{
+		for (size_t i = 0; i < TX_LANE_COUNT && lane < 0; i++)
 		{
-            this->callbackMutex_.lock();
-            for (auto& callback : this->shutdownCallbacks_)
-            {
-                (*(callback.get()))();
-            }
-            this->callbackMutex_.unlock();
-			break;
+			if (hasLaneData[i])
+			{
+				lane = static_cast<int>(i);
+			}
+		}
+	}
+	else // this->txScheduling_ == TxScheduling::WEIGHTED
+	{
+		// Smooth weighted round robin: every lane with data gets own weight,
+		// the lane with max current weight is sent and pays sum of weights.
+		int32_t weightSum = 0;
+		for (size_t i = 0; i < TX_LANE_COUNT; i++)
+		{
+			if (hasLaneData[i])
+			{
+				laneWeights[i] += this->txLaneWeights_[i];
+				weightSum += this->txLaneWeights_[i];
+				if (lane < 0 || laneWeights[i] > laneWeights[lane])
+				{
+					lane = static_cast<int>(i);
+				}
+			}
+		}
+		if (lane >= 0)
+		{
+			laneWeights[lane] -= weightSum;
+		}
+	}
+	return lane;
+}
+
+void ComPort::waitTxDriverQueue(size_t count, HANDLE hTimer)
+{
+	DWORD errors;
+	COMSTAT comStat;
+	while (this->isOpen_ && ClearCommError(this->hComPort_, &errors, &comStat) &&
+		   comStat.cbOutQue + count > this->txPartSize_)
+	{
+		// Wait for time of tx of excess data.
+		uint64_t excessNs = static_cast<uint64_t>(comStat.cbOutQue + count - this->txPartSize_) *
+			this->byteTimeNs_;
+		LARGE_INTEGER dueTime;
+		dueTime.QuadPart = -static_cast<LONGLONG>(excessNs / 100); // Relative time in 100 ns.
+		if (hTimer != nullptr && SetWaitableTimer(hTimer, &dueTime, 0, nullptr, nullptr, false))
+		{
+			WaitForSingleObject(hTimer, INFINITE);
+		}
+		else
+		{
+			Sleep(std::max<DWORD>(1, static_cast<DWORD>(excessNs / 1000000)));
 		}
 	}
-    endEventHadler.set_value();
 }
 
 }
@@ -1,7 +1,12 @@
 #pragma once
 
+#include "RxBroadcast.h"
+#include "LinkCodec.h"
+#include "ComPortCommon.h"
+#include "BasicComPort.h"
 #include <windows.h>
 #include <queue>
+#include <array>
 #include <mutex>
 #include <cstdint>
 #include <memory>
@@ -10,6 +15,7 @@
 #include <string>
 #include <future>
 #include <functional>
+#include <chrono>
 
 namespace kylsocomport
 {
@@ -18,66 +24,116 @@ using TxQueueElement = std::pair<std::unique_ptr<OVERLAPPED>, std::vector<uint8_
 using Callback = std::function<void(void)>;
 using UpCallback = std::unique_ptr<Callback>;
 
-class ComPort final
+// Config of core of ComPort. Tx goes by lanes of ComPort, so tx fifo of core
+// is not used.
+struct ComPortConfig
+{
+	static const size_t RX_QUEUE_SIZE = 512;
+	static const size_t TX_QUEUE_SIZE = 0;
+	static const ThreadingModel THREADING = ThreadingModel::INTERNAL_THREADS;
+	using Lock = std::mutex;
+	using Callback = kylsocomport::Callback;
+};
+
+// Full-featured port: BasicComPort core (port settings, rx fifo, open/close)
+// with tx lanes, rx broadcast, link compression, rx modes, rx statistics and
+// settings of threads. Events of core call all subscribers of event.
+class ComPort final : public BasicComPort<ComPortConfig, ComPort>
 {
 public:
-	enum class Result
-	{
-		SUCCESS,
-		ERROR_ALREADY_OPEN,
-		ERROR_BAD_PORT_NUM,
-		ERROR_OPEN,
-		ERROR_SET_PORT_CONFIG,
-		ERROR_INIT_RX_EVENT,
-		ERROR_PORT_CLOSE,
-		ERROR_TX_QUEUE_FULL,
-		ERROR_INIT_TX_EVENT
+	enum class ThreadPriority
+	{
+		IDLE			= THREAD_PRIORITY_IDLE,
+		LOWEST			= THREAD_PRIORITY_LOWEST,
+		BELOW_NORMAL	= THREAD_PRIORITY_BELOW_NORMAL,
+		NORMAL			= THREAD_PRIORITY_NORMAL,
+		ABOVE_NORMAL	= THREAD_PRIORITY_ABOVE_NORMAL,
+		HIGHEST			= THREAD_PRIORITY_HIGHEST,
+		TIME_CRITICAL	= THREAD_PRIORITY_TIME_CRITICAL
 	};
 
-	enum class Baudrate
-	{
-		_110	= CBR_110,
-		_300	= CBR_300,
-		_600	= CBR_600,
-		_1200	= CBR_1200,
-		_2400	= CBR_2400,
-		_4800	= CBR_4800,
-		_9600	= CBR_9600,
-		_14400	= CBR_14400,
-		_19200	= CBR_19200,
-		_38400	= CBR_38400,
-		_56000	= CBR_56000,
-		_57600	= CBR_57600,
-		_115200 = CBR_115200,
-		_128000 = CBR_128000,
-		_256000 = CBR_256000
+	enum class PriorityClass
+	{
+		IDLE			= IDLE_PRIORITY_CLASS,
+		BELOW_NORMAL	= BELOW_NORMAL_PRIORITY_CLASS,
+		NORMAL			= NORMAL_PRIORITY_CLASS,
+		ABOVE_NORMAL	= ABOVE_NORMAL_PRIORITY_CLASS,
+		HIGH			= HIGH_PRIORITY_CLASS,
+		REALTIME		= REALTIME_PRIORITY_CLASS
 	};
 
-	enum class WordLength
+	// Priority lanes of tx. Lane is chosen on txData() call.
+	enum class TxPriority
 	{
-		_7 = 7,
-		_8,
-		_9
+		URGENT,
+		HIGH,
+		NORMAL,
+		LOW
 	};
 
-	enum class StopBits
+	static const uint8_t TX_LANE_COUNT = 4;
+
+	enum class TxScheduling
 	{
-		_1,
-		_1_5,
-		_2
+		STRICT_PRIORITY,	// Lane is sent only if all lanes of higher priority are empty.
+		WEIGHTED	// Lanes share line by weights (smooth weighted round robin).
 	};
 
-	enum class Parity
+	// Settings of rx or tx thread. Applied by the thread itself at start.
+	struct ThreadConfig
 	{
-		NO,
-		ODD,
-		EVEN
+		DWORD_PTR		affinityMask = 0; // Mask of allowed cpu, 0 - don't change.
+		ThreadPriority	priority = ThreadPriority::NORMAL;
+		std::wstring	name; // Thread name for debugger, empty - don't change.
+		size_t			lockedStackSize = 0; // Bytes of stack prefaulted and locked in memory, 0 - disable.
 	};
 
-	enum class Event
+	// Stack left free below locked part for work of thread. If stack of thread
+	// is less than lockedStackSize with this reserve, then open() fails.
+	static const size_t LOCKED_STACK_RESERVE = 64 * 1024;
+
+	enum class RxMode
 	{
-		RX_DATA,
-		SHUTDOWN
+		EVENT,	// Rx thread sleep in kernel wait until data come.
+		POLL	// Rx thread spin on non-blocking read, then yield, then block.
+	};
+
+	// Backoff settings of POLL rx mode.
+	struct PollConfig
+	{
+		uint32_t	spinCount = 100000; // Count of empty reads with cpu pause before yield.
+		uint32_t	yieldCount = 1000; // Count of empty reads with thread yield before block.
+		DWORD		blockTimeoutMs = 10; // Max time of block wait of rx char, then read and block again.
+	};
+
+	// Statistics of rx thread.
+	// Wakeup latency is measured by steady clock from wakeup of rx thread
+	// (end of kernel wait or start of read in spin and yield stages) until
+	// data is in rx fifo. Wakeups, which gave no data for rx fifo (part of
+	// compressed frame), are not measured.
+	// Age of data is estimated as age of the oldest byte at the moment
+	// it was picked up: (bytes read + bytes left in driver - 1) * byte time.
+	// It is exact for continuous data streams only.
+	struct RxStats
+	{
+		uint64_t	chunkCount = 0; // Count of successful reads.
+		uint64_t	byteCount = 0;
+		uint64_t	spinWakeups = 0; // Chunks got in spin stage.
+		uint64_t	yieldWakeups = 0; // Chunks got in yield stage.
+		uint64_t	blockWakeups = 0; // Chunks got after kernel wait.
+		uint64_t	measuredWakeups = 0; // Wakeups with measured latency.
+		uint64_t	totalWakeupLatencyNs = 0; // Sum of measured latency of wakeups.
+		uint64_t	maxWakeupLatencyNs = 0;
+		uint64_t	totalEstimatedAgeNs = 0; // Sum of estimated age of data of wakeups.
+		uint64_t	maxEstimatedAgeNs = 0;
+	};
+
+	// Statistics of link compression.
+	struct CompressionStats
+	{
+		LinkCodec::Stats	codec;
+		double				txRatio = 0; // Size of tx data / size of its frames.
+		double				txEffectiveRate = 0; // Bytes of tx data per second at full load of line.
 	};
 
 	ComPort(uint8_t portNum, Baudrate baudrate, WordLength wordLength,
@@ -85,34 +141,57 @@ public:
 
 	~ComPort();
 
-	Result open();
+	// Return count of data in rx fifo.
+	uint16_t getRxDataCount();
+
+	// Get data from rx fifo into vector.
+	// Count - count of data then will be read from rx fifo.
+	// If count greater count of data in rx fifo then read all rx fifo.
+	void rxData(std::vector<uint8_t>& data, uint16_t count);	
 
-	void close();
+	// Put data into tx fifo of lane with given priority.
+	// Every lane has own fifo with own limits.
+	Result txData(std::vector<uint8_t> data, TxPriority priority = TxPriority::NORMAL);
+
+    std::string getTextOfResult(Result result) const;
 
-	bool isOpen() const
+	bool setRxThreadConfig(const ThreadConfig& config)
 	{
-		return this->isOpen_;
-	};
+		if (this->isOpen_)
+		{
+			return false;
+		}
+		else
+		{
+			this->rxThreadConfig_ = config;
+			return true;
+		}
+	}
+
+	const ThreadConfig& getRxThreadConfig() const
+	{
+		return this->rxThreadConfig_;
+	}
 
-	bool setPortNum(uint8_t portNum)
+	bool setTxThreadConfig(const ThreadConfig& config)
 	{
-		if (this->isOpen_ || portNum == 0)
+		if (this->isOpen_)
 		{
 			return false;
 		}
 		else
 		{
-			this->portNum_ = portNum;
+			this->txThreadConfig_ = config;
 			return true;
 		}
 	}
 
-	uint8_t getPortNum() const
+	const ThreadConfig& getTxThreadConfig() const
 	{
-		return this->portNum_;
+		return this->txThreadConfig_;
 	}
 
-	bool setBaudrate(Baudrate baudrate)
+	bool setTxScheduling(TxScheduling txScheduling)
 	{
 		if (this->isOpen_)
 		{
@@ -120,17 +199,42 @@ public:
 		}
 		else
 		{
-			this->baudrate_ = baudrate;
+			this->txScheduling_ = txScheduling;
 			return true;
 		}
 	}
 
-	Baudrate getBaudrate() const
+	TxScheduling getTxScheduling() const
 	{
-		return this->baudrate_;
+		return this->txScheduling_;
 	}
 
-	bool setWordLength(WordLength wordLength)
+	// Set weight of lane in WEIGHTED tx scheduling.
+	bool setTxLaneWeight(TxPriority priority, uint16_t weight)
+	{
+		if (this->isOpen_ || weight == 0)
+		{
+			return false;
+		}
+		else
+		{
+			this->txLaneWeights_[static_cast<size_t>(priority)] = weight;
+			return true;
+		}
+	}
+
+	uint16_t getTxLaneWeight(TxPriority priority) const
+	{
+		return this->txLaneWeights_[static_cast<size_t>(priority)];
+	}
+
+	// Set max time of tx of data, which is already passed to driver, when
+	// new data is chosen from lanes. Data is written to driver by parts of
+	// this size, so urgent data waits no more than one part.
+	// 0 - disable, data of one txData() call is written at once.
+	// Waits use high resolution timer. Before Windows 10 1803 there is no
+	// it, then waits are not shorter than timer tick (15.6 ms by default).
+	bool setTxLatencyBudget(uint32_t budgetUs)
 	{
 		if (this->isOpen_)
 		{
@@ -138,17 +242,20 @@ public:
 		}
 		else
 		{
-			this->wordLength_ = wordLength;
+			this->txLatencyBudgetUs_ = budgetUs;
 			return true;
 		}
 	}
 
-	WordLength getWordLength() const
+	uint32_t getTxLatencyBudget() const
 	{
-		return this->wordLength_;
+		return this->txLatencyBudgetUs_;
 	}
 
-	bool setStopBits(StopBits stopBits)
+	// Enable transparent compression of link (both ends must enable it).
+	// Data of every txData() call is sent as one compressed frame, so it must
+	// not exceed LinkCodec::MAX_BLOCK_SIZE, else txData() returns ERROR_TX_QUEUE_FULL.
+	bool setCompression(bool isEnable)
 	{
 		if (this->isOpen_)
 		{
@@ -156,17 +263,19 @@ public:
 		}
 		else
 		{
-			this->stopBits_ = stopBits;
+			this->isCompression_ = isEnable;
 			return true;
 		}
 	}
 
-	StopBits getStopBits() const
+	bool getCompression() const
 	{
-		return this->stopBits_;
+		return this->isCompression_;
 	}
 
-	bool setParity(Parity parity)
+	// Data shorter than minSize is sent without compression (but in frame),
+	// so short latency-sensitive messages don't pay for it.
+	bool setCompressionMinSize(uint16_t minSize)
 	{
 		if (this->isOpen_)
 		{
@@ -174,27 +283,85 @@ public:
 		}
 		else
 		{
-			this->parity_ = parity;
+			this->linkCodec_.setMinCompressSize(minSize);
 			return true;
 		}
 	}
 
-	Parity getParity() const
+	uint16_t getCompressionMinSize() const
 	{
-		return this->parity_;
+		return this->linkCodec_.getMinCompressSize();
 	}
 
-	// Return count of data in rx fifo.
-	uint16_t getRxDataCount();
+	CompressionStats getCompressionStats();
 
-	// Get data from rx fifo into vector.
-	// Count - count of data then will be read from rx fifo.
-	// If count greater count of data in rx fifo then read all rx fifo.
-	void rxData(std::vector<uint8_t>& data, uint16_t count);	
+	bool setRxMode(RxMode rxMode)
+	{
+		if (this->isOpen_)
+		{
+			return false;
+		}
+		else
+		{
+			this->rxMode_ = rxMode;
+			return true;
+		}
+	}
 
-	Result txData(std::vector<uint8_t> data);
+	RxMode getRxMode() const
+	{
+		return this->rxMode_;
+	}
 
-    std::string getTextOfResult(Result result) const;
+	bool setPollConfig(const PollConfig& config)
+	{
+		if (this->isOpen_)
+		{
+			return false;
+		}
+		else
+		{
+			this->pollConfig_ = config;
+			return true;
+		}
+	}
+
+	const PollConfig& getPollConfig() const
+	{
+		return this->pollConfig_;
+	}
+
+	// Rx statistics are collected only after enable, because estimation of
+	// age of data needs extra syscall per read. Disabled by default.
+	bool setRxStatsEnable(bool isEnable)
+	{
+		if (this->isOpen_)
+		{
+			return false;
+		}
+		else
+		{
+			this->isRxStatsEnable_ = isEnable;
+			return true;
+		}
+	}
+
+	bool isRxStatsEnable() const
+	{
+		return this->isRxStatsEnable_;
+	}
+
+	RxStats getRxStats();
+
+	void resetRxStats();
+
+	// Set priority class of whole process (needed for TIME_CRITICAL thread
+	// priority to be above other processes).
+	static bool setProcessPriorityClass(PriorityClass priorityClass);
+
+	// Lock working set of process in memory (analog of mlockall).
+	// minSize/maxSize - bounds of working set in bytes.
+	static bool lockProcessMemory(size_t minSize, size_t maxSize);
 
 	// Set subscribe on event.
     void setSubscribeOnEvent(Event event, UpCallback callback);
@@ -202,31 +369,57 @@ public:
 	// Reset subscribe on event.
     void resetSubscribeOnEvent(Event event, UpCallback callback);
 
+	// Get buffer of received data with many independent readers.
+	// Unlike rx fifo, every subscriber of it gets all received data.
+	// Rx thread splits received data by its capacity, so change capacity
+	// only while port is closed.
+	RxBroadcast& getRxBroadcast()
+	{
+		return this->rxBroadcast_;
+	}
+
 private:
-	HANDLE						hComPort_; // Comport object.
-	DCB							dcbComPortParams_; // Comport settings object.
-	OVERLAPPED					hRxOverlapped_; // Async rx data object.
-	std::atomic<bool>			isOpen_;
-
-	// Comport settings.
-	uint8_t						portNum_;
-	Baudrate					baudrate_;
-	WordLength					wordLength_;
-	StopBits					stopBits_;
-	Parity						parity_;
-
-	// Fields for rx queue.
-	uint16_t					rxQueueSize_;
-	std::queue<uint8_t>			rxQueue_;
-	std::mutex					rxQueueMutex_;
-
-	// Fields for tx queue.
+	friend class BasicComPort<ComPortConfig, ComPort>;
+
+	// Callbacks of core call subscribers, so they are set only by ComPort.
+	using BasicComPort::setCallback;
+
+	uint32_t					byteTimeNs_; // Time of transmission of one byte on line.
+
+	// Settings of rx/tx threads.
+	ThreadConfig				rxThreadConfig_;
+	ThreadConfig				txThreadConfig_;
+
+	// Fields for link compression.
+	bool						isCompression_;
+	LinkCodec					linkCodec_;
+	std::vector<uint8_t>		rxDecodeBuffer_; // Data of decoded frames, used by rx thread.
+
+	// Fields for rx mode.
+	RxMode						rxMode_;
+	PollConfig					pollConfig_;
+	OVERLAPPED					hRxWaitOverlapped_; // Async wait of rx char object in POLL mode.
+	bool						isRxStatsEnable_;
+	RxStats						rxStats_;
+	std::mutex					rxStatsMutex_;
+	std::chrono::steady_clock::time_point	rxWakeupTime_; // Used by rx thread only.
+	bool						isRxWakeupPending_; // Latency of wakeup is not measured yet.
+
+	RxBroadcast					rxBroadcast_;
+
+	// Fields for tx queue (limits are for every lane).
 	uint16_t					txDataQueueSize_;
-	std::atomic<uint16_t>		txDataQueueUse_;
+	std::array<uint16_t, TX_LANE_COUNT>	txDataQueueUse_;
 	uint8_t						txOverlappedQueueSize_;
-	std::queue<TxQueueElement>	txQueue_;
+	std::array<std::queue<TxQueueElement>, TX_LANE_COUNT>	txQueues_;
 	std::mutex					txQueueMutex_;
 
+	// Fields for tx scheduling.
+	TxScheduling				txScheduling_;
+	std::array<uint16_t, TX_LANE_COUNT>	txLaneWeights_;
+	uint32_t					txLatencyBudgetUs_;
+	uint32_t					txPartSize_; // Max size of data written at once, 0 - unlimited.
+
     std::condition_variable		releaseTxDataThreadWork_;
 	std::mutex					txDataThreadMutex_;
     bool						isReleaseTxDataThread_;
@@ -238,13 +431,68 @@ private:
 	// Fields for handle callback.
     std::vector<UpCallback>		rxDataCallbacks_;
     std::vector<UpCallback>		shutdownCallbacks_;
+    std::vector<UpCallback>		txDataCallbacks_;
     std::mutex                  callbackMutex_;
 
+	// Hooks of core: io of rx modes and own rx and tx threads.
+	Result initIo();
+
+	void closeIo();
+
+	Result startThreads(std::true_type);
+
+	void stopThreads(std::true_type);
+
+	// Call subscribers of event.
+	void callSubscribers(std::vector<UpCallback>& callbacks);
+
 	// Method for rx data in other thread.
-    void doRxData(std::promise<void> endEventHadler);
+    void doRxData(std::promise<bool> startEventHandler, std::promise<void> endEventHadler);
 
 	// Method for tx data in other thread.
-    void doTxData(std::promise<void> endEventHadler);
+    void doTxData(std::promise<bool> startEventHandler, std::promise<void> endEventHadler);
+
+	// Rx loop of EVENT mode.
+	bool doRxEventLoop();
+
+	// Rx loop of POLL mode.
+	bool doRxPollLoop();
+
+	// Decode received data, if compression is enabled, and put it.
+	void onRxData(const uint8_t* data, DWORD count);
+
+	// Put received data into rx fifo and rx broadcast and call rx callbacks.
+	void putRxData(const uint8_t* data, DWORD count);
+
+	// Stage of rx thread, in which data was got.
+	enum class RxStage
+	{
+		CONTINUOUS, // Data was read without waiting.
+		SPIN,
+		YIELD,
+		BLOCK
+	};
+
+	// Update rx statistics after read of data.
+	// isDrained - read got all data of driver queue.
+	void updateRxStats(DWORD count, RxStage stage, bool isDrained);
+
+	// Remember time of wakeup of rx thread, if rx statistics are enabled.
+	void markRxWakeup();
+
+	// Measure latency of wakeup, after its data was put into rx fifo.
+	void measureRxWakeup();
+
+	// Choose lane for next tx. Return -1 if all lanes are empty.
+	// laneWeights - current weights of WEIGHTED scheduling, kept by tx thread.
+	int chooseTxLane(const bool* hasLaneData, int32_t* laneWeights) const;
+
+	// Wait while driver tx queue is too full to add count of data in budget.
+	// hTimer - waitable timer for wait, nullptr - use Sleep().
+	void waitTxDriverQueue(size_t count, HANDLE hTimer);
+
+	// Apply settings to current thread.
+	static bool applyThreadConfig(const ThreadConfig& config);
 };
 
 } // usercomport
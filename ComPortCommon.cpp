@@ -0,0 +1,94 @@
+#include "ComPortCommon.h"
+#include <cstring>
+
+namespace kylsocomport
+{
+
+std::string getTextOfResult(Result result)
+{
+    std::string sResult;
+    switch (result)
+    {
+        case Result::SUCCESS:
+            sResult = "success";
+            break;
+        case Result::ERROR_ALREADY_OPEN:
+            sResult = "comport already open";
+            break;
+        case Result::ERROR_BAD_PORT_NUM:
+            sResult = "bad comport num";
+            break;
+        case Result::ERROR_OPEN:
+            sResult = "cant open";
+            break;
+        case Result::ERROR_SET_PORT_CONFIG:
+            sResult = "cant set comport config";
+            break;
+        case Result::ERROR_INIT_RX_EVENT:
+            sResult = "cant initialize rx event";
+            break;
+        case Result::ERROR_PORT_CLOSE:
+            sResult = "comport is close";
+            break;
+        case Result::ERROR_TX_QUEUE_FULL:
+            sResult = "tx queue full";
+            break;
+        case Result::ERROR_INIT_TX_EVENT:
+            sResult = "cant initialize tx event";
+            break;
+        case Result::ERROR_SET_THREAD_CONFIG:
+            sResult = "cant set thread config";
+            break;
+    }
+    return sResult;
+}
+
+Result openPortHandle(uint8_t portNum, Baudrate baudrate, WordLength wordLength,
+					  StopBits stopBits, Parity parity, HANDLE& hComPort)
+{
+	hComPort = nullptr;
+	std::string portName = "\\\\.\\COM";
+	if (portNum == 0)
+	{
+		return Result::ERROR_BAD_PORT_NUM;
+	}
+	portName += std::to_string(portNum);
+	HANDLE hPort = CreateFile(portName.c_str(), GENERIC_READ | GENERIC_WRITE,
+							  0, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
+	if (hPort == INVALID_HANDLE_VALUE)
+	{
+		return Result::ERROR_OPEN;
+	}
+	DCB dcbComPortParams;
+	std::memset(&dcbComPortParams, 0, sizeof(dcbComPortParams));
+	dcbComPortParams.DCBlength = sizeof(dcbComPortParams);
+	if (!GetCommState(hPort, &dcbComPortParams))
+	{
+		CloseHandle(hPort);
+		return Result::ERROR_SET_PORT_CONFIG;
+	}
+	dcbComPortParams.BaudRate = static_cast<DWORD>(baudrate);
+	dcbComPortParams.ByteSize = static_cast<BYTE>(wordLength);
+	dcbComPortParams.StopBits = static_cast<BYTE>(stopBits);
+	dcbComPortParams.Parity = static_cast<BYTE>(parity);
+	if (!SetCommState(hPort, &dcbComPortParams))
+	{
+		CloseHandle(hPort);
+		return Result::ERROR_SET_PORT_CONFIG;
+	}
+	hComPort = hPort;
+	return Result::SUCCESS;
+}
+
+uint32_t getByteTimeNs(Baudrate baudrate, WordLength wordLength,
+					   StopBits stopBits, Parity parity)
+{
+	// Bits of one byte: start bit, data bits, parity bit and stop bits (in halves).
+	uint32_t halfBitsPerByte = 2 * (1 + static_cast<uint32_t>(wordLength)) +
+		(parity != Parity::NO ? 2 : 0) +
+		(stopBits == StopBits::_1 ? 2 : (stopBits == StopBits::_1_5 ? 3 : 4));
+	return static_cast<uint32_t>(500000000ull * halfBitsPerByte /
+								 static_cast<uint32_t>(baudrate));
+}
+
+} // kylsocomport
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <windows.h>
+#include <cstdint>
+#include <string>
+
+namespace kylsocomport
+{
+
+// Types and functions common for ComPort and BasicComPort.
+
+enum class Result
+{
+	SUCCESS,
+	ERROR_ALREADY_OPEN,
+	ERROR_BAD_PORT_NUM,
+	ERROR_OPEN,
+	ERROR_SET_PORT_CONFIG,
+	ERROR_INIT_RX_EVENT,
+	ERROR_PORT_CLOSE,
+	ERROR_TX_QUEUE_FULL,
+	ERROR_INIT_TX_EVENT,
+	ERROR_SET_THREAD_CONFIG
+};
+
+enum class Baudrate
+{
+	_110	= CBR_110,
+	_300	= CBR_300,
+	_600	= CBR_600,
+	_1200	= CBR_1200,
+	_2400	= CBR_2400,
+	_4800	= CBR_4800,
+	_9600	= CBR_9600,
+	_14400	= CBR_14400,
+	_19200	= CBR_19200,
+	_38400	= CBR_38400,
+	_56000	= CBR_56000,
+	_57600	= CBR_57600,
+	_115200 = CBR_115200,
+	_128000 = CBR_128000,
+	_256000 = CBR_256000
+};
+
+enum class WordLength
+{
+	_7 = 7,
+	_8,
+	_9
+};
+
+enum class StopBits
+{
+	_1,
+	_1_5,
+	_2
+};
+
+enum class Parity
+{
+	NO,
+	ODD,
+	EVEN
+};
+
+enum class Event
+{
+	RX_DATA,
+	SHUTDOWN,
+	TX_DATA // Data of one txData() call was written to port.
+};
+
+// Return text description of result.
+std::string getTextOfResult(Result result);
+
+// Open port "COM<portNum>" for overlapped io and set its settings.
+// On success hComPort is opened handle, else it is nullptr.
+Result openPortHandle(uint8_t portNum, Baudrate baudrate, WordLength wordLength,
+					  StopBits stopBits, Parity parity, HANDLE& hComPort);
+
+// Return time of transmission of one byte on line (with start, parity and stop bits).
+uint32_t getByteTimeNs(Baudrate baudrate, WordLength wordLength,
+					   StopBits stopBits, Parity parity);
+
+} // kylsocomport
@@ -0,0 +1,486 @@
+#include "ComPortMux.h"
+#include <algorithm>
+#include <random>
+
+namespace kylsocomport
+{
+
+const uint8_t ComPortMux::FRAME_SOF;
+const uint8_t ComPortMux::DATA_HEADER_SIZE;
+const uint8_t ComPortMux::CREDIT_SIZE;
+const std::chrono::milliseconds ComPortMux::PROBE_INTERVAL{100};
+
+ComPortMux::Channel::Channel(ComPortMux& mux, uint8_t channelNum) :
+	mux_(mux), channelNum_(channelNum)
+{
+	this->rxEpoch_ = 0;
+	this->rxOffset_ = 0;
+	this->rxConsumedCount_ = 0;
+	this->rxCreditSentCount_ = 0;
+	this->isCreditPending_ = false;
+	this->txSentCount_ = 0;
+	this->txPeerConsumedCount_ = 0;
+	this->isProbeSent_ = false;
+}
+
+uint16_t ComPortMux::Channel::getRxDataCount()
+{
+	std::lock_guard<std::mutex> lock(this->mux_.mutex_);
+	return static_cast<uint16_t>(this->rxQueue_.size());
+}
+
+void ComPortMux::Channel::rxData(std::vector<uint8_t>& data, uint16_t count)
+{
+	std::unique_lock<std::mutex> lock(this->mux_.mutex_);
+	size_t readCount = std::min<size_t>(count, this->rxQueue_.size());
+	data.insert(data.end(), this->rxQueue_.begin(), this->rxQueue_.begin() + readCount);
+	this->rxQueue_.erase(this->rxQueue_.begin(), this->rxQueue_.begin() + readCount);
+	this->consume(static_cast<uint32_t>(readCount));
+	auto sentChannels = this->mux_.pumpTx();
+	lock.unlock();
+	this->mux_.callCallbacks(ComPort::Event::TX_DATA, sentChannels);
+}
+
+ComPort::Result ComPortMux::Channel::txData(std::vector<uint8_t> data)
+{
+	std::unique_lock<std::mutex> lock(this->mux_.mutex_);
+	if (!this->mux_.comPort_.isOpen())
+	{
+		return ComPort::Result::ERROR_PORT_CLOSE;
+	}
+	ComPort::Result result = ComPort::Result::SUCCESS;
+	if (data.size() > this->mux_.channelBufferSize_ - this->txQueue_.size())
+	{
+		result = ComPort::Result::ERROR_TX_QUEUE_FULL;
+	}
+	else
+	{
+		this->txQueue_.insert(this->txQueue_.end(), data.begin(), data.end());
+	}
+	// Also with full fifo, because it's time to repeat probe of channel can come.
+	auto sentChannels = this->mux_.pumpTx();
+	lock.unlock();
+	this->mux_.callCallbacks(ComPort::Event::TX_DATA, sentChannels);
+	return result;
+}
+
+void ComPortMux::Channel::setSubscribeOnEvent(ComPort::Event event, UpCallback callback)
+{
+	std::vector<UpCallback>* callbacks = this->getCallbacks(event);
+	std::lock_guard<std::mutex> lock(this->callbackMutex_);
+	for (auto& i : *callbacks)
+	{
+		if (i.get() == callback.get())
+		{
+			callback.release(); // Object is owned by stored pointer.
+			return; // This callback already set.
+		}
+	}
+	// This callback not set.
+	callbacks->push_back(std::move(callback));
+}
+
+void ComPortMux::Channel::resetSubscribeOnEvent(ComPort::Event event, UpCallback callback)
+{
+	std::vector<UpCallback>* callbacks = this->getCallbacks(event);
+	std::lock_guard<std::mutex> lock(this->callbackMutex_);
+	for (auto i = callbacks->begin(); i != callbacks->end(); ++i)
+	{
+		if (i->get() == callback.get())
+		{
+			callbacks->erase(i); // This callback set.
+			callback.release(); // Object was deleted with stored pointer.
+			break;
+		}
+	}
+}
+
+std::vector<UpCallback>* ComPortMux::Channel::getCallbacks(ComPort::Event event)
+{
+	if (event == ComPort::Event::RX_DATA)
+	{
+		return &this->rxDataCallbacks_;
+	}
+	else if (event == ComPort::Event::TX_DATA)
+	{
+		return &this->txDataCallbacks_;
+	}
+	else // event == ComPort::Event::SHUTDOWN
+	{
+		return &this->shutdownCallbacks_;
+	}
+}
+
+void ComPortMux::Channel::consume(uint32_t count)
+{
+	this->rxConsumedCount_ += count;
+	if (this->rxConsumedCount_ - this->rxCreditSentCount_ >= this->mux_.channelBufferSize_ / 4u)
+	{
+		this->isCreditPending_ = true;
+	}
+}
+
+void ComPortMux::Channel::resyncRx(uint8_t epoch, uint32_t offset)
+{
+	this->rxEpoch_ = epoch;
+	this->rxOffset_ = offset;
+	// Peer counts place from offset, data in fifo is not read yet.
+	this->rxConsumedCount_ = offset - static_cast<uint32_t>(this->rxQueue_.size());
+	this->rxCreditSentCount_ = this->rxConsumedCount_;
+	this->isCreditPending_ = true;
+}
+
+void ComPortMux::Channel::callCallbacks(ComPort::Event event)
+{
+	std::vector<UpCallback>* callbacks = this->getCallbacks(event);
+	std::lock_guard<std::mutex> lock(this->callbackMutex_);
+	for (auto& callback : *callbacks)
+	{
+		(*(callback.get()))();
+	}
+}
+
+ComPortMux::ComPortMux(ComPort& comPort, uint8_t channelCount,
+					   uint16_t channelBufferSize, uint8_t maxFramePayload) :
+	comPort_(comPort), channelBufferSize_(channelBufferSize),
+	maxFramePayload_(std::min<uint8_t>(std::max<uint8_t>(maxFramePayload, 1),
+									   UINT8_MAX - DATA_HEADER_SIZE))
+{
+	for (uint8_t i = 0; i < channelCount; i++)
+	{
+		this->channels_.emplace_back(new Channel(*this, i));
+	}
+	// Restarted peer finds out by new epoch, that offsets start again.
+	this->txEpoch_ = static_cast<uint8_t>(std::random_device{}());
+	this->txNextChannel_ = 0;
+	this->isTxFrameInWork_ = false;
+	this->portOpenCount_ = this->comPort_.getOpenCount();
+	this->parseState_ = ParseState::SOF;
+	this->parseChannel_ = 0;
+	this->parseType_ = FrameType::DATA;
+	this->parseLength_ = 0;
+	this->parseCrc_ = 0;
+
+	// Mux must get all data, so rx thread waits it if needed.
+	this->rxSubscriberId_ = this->comPort_.getRxBroadcast().subscribe(
+		RxBroadcast::SlowPolicy::BLOCK);
+
+	this->rxDataCallback_ = new Callback{[this]() { this->onRxData(); }};
+	this->txDataCallback_ = new Callback{[this]() { this->onTxData(); }};
+	this->shutdownCallback_ = new Callback{[this]() { this->onShutdown(); }};
+	this->comPort_.setSubscribeOnEvent(ComPort::Event::RX_DATA, UpCallback{this->rxDataCallback_});
+	this->comPort_.setSubscribeOnEvent(ComPort::Event::TX_DATA, UpCallback{this->txDataCallback_});
+	this->comPort_.setSubscribeOnEvent(ComPort::Event::SHUTDOWN, UpCallback{this->shutdownCallback_});
+}
+
+ComPortMux::~ComPortMux()
+{
+	this->comPort_.resetSubscribeOnEvent(ComPort::Event::RX_DATA, UpCallback{this->rxDataCallback_});
+	this->comPort_.resetSubscribeOnEvent(ComPort::Event::TX_DATA, UpCallback{this->txDataCallback_});
+	this->comPort_.resetSubscribeOnEvent(ComPort::Event::SHUTDOWN, UpCallback{this->shutdownCallback_});
+	this->comPort_.getRxBroadcast().unsubscribe(this->rxSubscriberId_);
+}
+
+void ComPortMux::onRxData()
+{
+	std::vector<uint8_t> rxChannels;
+	std::unique_lock<std::mutex> lock(this->mutex_);
+	this->checkPortReopen();
+	RxBroadcast& rxBroadcast = this->comPort_.getRxBroadcast();
+	RxBroadcast::View view = rxBroadcast.peek(this->rxSubscriberId_);
+	auto parse = [this, &rxChannels](const uint8_t* data, size_t size)
+	{
+		for (size_t i = 0; i < size; i++)
+		{
+			uint8_t channelNum = this->parseByte(data[i]);
+			if (channelNum < this->channels_.size() &&
+				std::find(rxChannels.begin(), rxChannels.end(), channelNum) == rxChannels.end())
+			{
+				rxChannels.push_back(channelNum);
+			}
+		}
+	};
+	parse(view.first, view.firstSize);
+	parse(view.second, view.secondSize);
+	rxBroadcast.release(this->rxSubscriberId_, view.size());
+
+	// Got credit can allow tx of channels.
+	auto sentChannels = this->pumpTx();
+	lock.unlock();
+	this->callCallbacks(ComPort::Event::RX_DATA, rxChannels);
+	this->callCallbacks(ComPort::Event::TX_DATA, sentChannels);
+}
+
+void ComPortMux::onTxData()
+{
+	std::unique_lock<std::mutex> lock(this->mutex_);
+	this->isTxFrameInWork_ = false;
+	auto sentChannels = this->pumpTx();
+	lock.unlock();
+	this->callCallbacks(ComPort::Event::TX_DATA, sentChannels);
+}
+
+void ComPortMux::onShutdown()
+{
+	std::unique_lock<std::mutex> lock(this->mutex_);
+	this->resetLinkState();
+	lock.unlock();
+	for (auto& channel : this->channels_)
+	{
+		channel->callCallbacks(ComPort::Event::SHUTDOWN);
+	}
+}
+
+void ComPortMux::resetLinkState()
+{
+	this->isTxFrameInWork_ = false;
+	for (auto& channel : this->channels_)
+	{
+		channel->isProbeSent_ = false;
+	}
+	this->parseState_ = ParseState::SOF;
+	this->parsePayload_.clear();
+}
+
+void ComPortMux::checkPortReopen()
+{
+	uint32_t portOpenCount = this->comPort_.getOpenCount();
+	if (portOpenCount != this->portOpenCount_)
+	{
+		// Tx fifo of port was cleared by close(), so end of tx of frame won't come.
+		this->portOpenCount_ = portOpenCount;
+		this->resetLinkState();
+	}
+}
+
+uint8_t ComPortMux::parseByte(uint8_t byte)
+{
+	uint8_t channelCount = static_cast<uint8_t>(this->channels_.size());
+	if (this->parseState_ != ParseState::SOF && this->parseState_ != ParseState::CRC)
+	{
+		this->parseCrc_ = calcCrc8(this->parseCrc_, &byte, 1);
+	}
+	switch (this->parseState_)
+	{
+		case ParseState::SOF:
+			if (byte == FRAME_SOF)
+			{
+				this->parseCrc_ = 0;
+				this->parseState_ = ParseState::CHANNEL;
+			}
+			break;
+		case ParseState::CHANNEL:
+			this->parseChannel_ = byte;
+			this->parseState_ = (byte < channelCount) ? ParseState::TYPE : ParseState::SOF;
+			break;
+		case ParseState::TYPE:
+			this->parseType_ = static_cast<FrameType>(byte);
+			this->parseState_ = (byte <= static_cast<uint8_t>(FrameType::CREDIT)) ?
+				ParseState::LENGTH : ParseState::SOF;
+			break;
+		case ParseState::LENGTH:
+			this->parseLength_ = byte;
+			this->parsePayload_.clear();
+			if ((this->parseType_ == FrameType::DATA && byte < DATA_HEADER_SIZE) ||
+				(this->parseType_ == FrameType::CREDIT && byte != CREDIT_SIZE))
+			{
+				this->parseState_ = ParseState::SOF;
+			}
+			else
+			{
+				this->parseState_ = ParseState::PAYLOAD;
+			}
+			break;
+		case ParseState::PAYLOAD:
+			this->parsePayload_.push_back(byte);
+			if (this->parsePayload_.size() == this->parseLength_)
+			{
+				this->parseState_ = ParseState::CRC;
+			}
+			break;
+		case ParseState::CRC:
+		{
+			this->parseState_ = ParseState::SOF;
+			if (byte != this->parseCrc_)
+			{
+				break; // Bad frame, search next one.
+			}
+			Channel& channel = *this->channels_[this->parseChannel_];
+			uint8_t epoch = this->parsePayload_[0];
+			uint32_t value = readUint32(this->parsePayload_.data() + 1);
+			if (this->parseType_ == FrameType::CREDIT)
+			{
+				if (epoch != this->txEpoch_)
+				{
+					break; // Credit for stream of previous mux of peer.
+				}
+				// Probe is sent again only after progress, else peer without
+				// place and this end would exchange probes and credits forever.
+				if (value != channel.txPeerConsumedCount_)
+				{
+					channel.txPeerConsumedCount_ = value;
+					channel.isProbeSent_ = false;
+				}
+				break;
+			}
+
+			// this->parseType_ == FrameType::DATA
+			uint32_t offset = value;
+			uint32_t size = static_cast<uint32_t>(this->parsePayload_.size() - DATA_HEADER_SIZE);
+			// Frames come in order, so offset goes back only after restart of peer
+			// (epoch of new mux of peer can be equal to previous one by chance).
+			if (epoch != channel.rxEpoch_ || static_cast<int32_t>(offset - channel.rxOffset_) < 0)
+			{
+				channel.resyncRx(epoch, offset);
+			}
+			// Data of lost frames will not come, so count it as read.
+			uint32_t lostCount = offset - channel.rxOffset_;
+			channel.rxOffset_ = offset + size;
+			if (size == 0)
+			{
+				// Peer has no credit, send it all (last credit frame could be lost).
+				channel.consume(lostCount);
+				channel.isCreditPending_ = true;
+				break;
+			}
+			// Peer keeps to credits, so data has place (if no frame was lost).
+			uint32_t count = std::min<uint32_t>(size,
+				this->channelBufferSize_ - static_cast<uint32_t>(channel.rxQueue_.size()));
+			channel.rxQueue_.insert(channel.rxQueue_.end(),
+									this->parsePayload_.begin() + DATA_HEADER_SIZE,
+									this->parsePayload_.begin() + DATA_HEADER_SIZE + count);
+			channel.consume(lostCount + size - count);
+			return this->parseChannel_;
+		}
+	}
+	return channelCount;
+}
+
+std::vector<uint8_t> ComPortMux::pumpTx()
+{
+	std::vector<uint8_t> sentChannels;
+	this->checkPortReopen();
+	if (!this->comPort_.isOpen())
+	{
+		return sentChannels;
+	}
+	if (this->isTxFrameInWork_)
+	{
+		return sentChannels; // Continue after tx of frame.
+	}
+	auto sendFrame = [this](uint8_t channelNum, FrameType type,
+							const uint8_t* payload, uint8_t size)
+	{
+		std::vector<uint8_t> frame;
+		frame.reserve(size + 5u);
+		frame.push_back(FRAME_SOF);
+		frame.push_back(channelNum);
+		frame.push_back(static_cast<uint8_t>(type));
+		frame.push_back(size);
+		frame.insert(frame.end(), payload, payload + size);
+		frame.push_back(calcCrc8(0, frame.data() + 1, frame.size() - 1));
+		this->isTxFrameInWork_ =
+			this->comPort_.txData(std::move(frame)) == ComPort::Result::SUCCESS;
+		return this->isTxFrameInWork_;
+	};
+
+	// Credits first, they are short and release tx of peer.
+	for (auto& channel : this->channels_)
+	{
+		if (channel->isCreditPending_)
+		{
+			uint32_t consumedCount = channel->rxConsumedCount_;
+			uint8_t payload[CREDIT_SIZE];
+			payload[0] = channel->rxEpoch_;
+			writeUint32(consumedCount, payload + 1);
+			if (sendFrame(channel->channelNum_, FrameType::CREDIT, payload, sizeof(payload)))
+			{
+				channel->isCreditPending_ = false;
+				channel->rxCreditSentCount_ = consumedCount;
+			}
+			return sentChannels;
+		}
+	}
+
+	// Data of channels by turns, one frame per channel in round.
+	uint8_t channelCount = static_cast<uint8_t>(this->channels_.size());
+	for (uint8_t i = 0; i < channelCount; i++)
+	{
+		uint8_t channelNum = static_cast<uint8_t>((this->txNextChannel_ + i) % channelCount);
+		Channel& channel = *this->channels_[channelNum];
+		// Data in way can be more than buffer after resync of restarted peer.
+		uint32_t unreadCount = channel.txSentCount_ - channel.txPeerConsumedCount_;
+		uint32_t credit = (unreadCount < this->channelBufferSize_) ?
+			this->channelBufferSize_ - unreadCount : 0;
+		size_t size = std::min<size_t>({channel.txQueue_.size(), credit,
+										this->maxFramePayload_});
+		bool isProbe = (size == 0 && !channel.txQueue_.empty() &&
+						(!channel.isProbeSent_ ||
+						 std::chrono::steady_clock::now() - channel.txProbeTime_ >= PROBE_INTERVAL));
+		if (size == 0 && !isProbe)
+		{
+			continue;
+		}
+		std::vector<uint8_t> payload(DATA_HEADER_SIZE);
+		payload[0] = this->txEpoch_;
+		writeUint32(channel.txSentCount_, payload.data() + 1);
+		payload.insert(payload.end(), channel.txQueue_.begin(), channel.txQueue_.begin() + size);
+		if (!sendFrame(channelNum, FrameType::DATA, payload.data(),
+					   static_cast<uint8_t>(payload.size())))
+		{
+			return sentChannels; // Tx fifo of port is full, continue after tx of other data.
+		}
+		if (isProbe)
+		{
+			channel.isProbeSent_ = true;
+			channel.txProbeTime_ = std::chrono::steady_clock::now();
+			return sentChannels;
+		}
+		channel.txQueue_.erase(channel.txQueue_.begin(), channel.txQueue_.begin() + size);
+		channel.txSentCount_ += static_cast<uint32_t>(size);
+		this->txNextChannel_ = static_cast<uint8_t>((channelNum + 1) % channelCount);
+		sentChannels.push_back(channelNum);
+		return sentChannels;
+	}
+	return sentChannels;
+}
+
+void ComPortMux::callCallbacks(ComPort::Event event, const std::vector<uint8_t>& channelNums)
+{
+	for (auto channelNum : channelNums)
+	{
+		this->channels_[channelNum]->callCallbacks(event);
+	}
+}
+
+uint32_t ComPortMux::readUint32(const uint8_t* data)
+{
+	return static_cast<uint32_t>(data[0]) |
+		   (static_cast<uint32_t>(data[1]) << 8) |
+		   (static_cast<uint32_t>(data[2]) << 16) |
+		   (static_cast<uint32_t>(data[3]) << 24);
+}
+
+void ComPortMux::writeUint32(uint32_t value, uint8_t* data)
+{
+	data[0] = static_cast<uint8_t>(value);
+	data[1] = static_cast<uint8_t>(value >> 8);
+	data[2] = static_cast<uint8_t>(value >> 16);
+	data[3] = static_cast<uint8_t>(value >> 24);
+}
+
+uint8_t ComPortMux::calcCrc8(uint8_t crc, const uint8_t* data, size_t size)
+{
+	// CRC-8, polynomial x^8 + x^2 + x + 1.
+	for (size_t i = 0; i < size; i++)
+	{
+		crc ^= data[i];
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = static_cast<uint8_t>((crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1));
+		}
+	}
+	return crc;
+}
+
+} // kylsocomport
@@ -0,0 +1,216 @@
+#pragma once
+
+#include "ComPort.h"
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+namespace kylsocomport
+{
+
+// Multiplexer of several logical channels over one ComPort.
+// Data of channels is sent in frames:
+// [SOF][channel][type][length][payload...][crc8 of channel..payload].
+// Frames of channels are sent by turns (round robin). Mux keeps only one
+// frame in tx fifo of port, so a big transfer in one channel delays other
+// channels by one frame (plus data in tx buffer of driver). The port should
+// not be used for tx by others, because end of their tx is taken as end of
+// tx of frame.
+// Flow control is credit-based: a channel sends data only while the peer
+// has place for it in rx buffer of the channel. Both ends must use
+// ComPortMux with equal channel count and buffer size.
+// Data frames carry offset of their data in stream of channel, so the
+// receiver counts data of lost frames as read and the credit isn't lost.
+// Data and credit frames also carry epoch of stream, which is chosen
+// randomly by every mux. If peer was restarted (its epoch changed or its
+// offset went back), the receiver takes offset of frame as start of stream
+// and sends credit. Credit of other epoch is for stream of previous mux of
+// peer and it's ignored.
+class ComPortMux final
+{
+public:
+	class Channel final
+	{
+	public:
+		// Return count of data in rx fifo of channel.
+		uint16_t getRxDataCount();
+
+		// Get data from rx fifo of channel into vector.
+		// If count greater count of data in rx fifo then read all rx fifo.
+		void rxData(std::vector<uint8_t>& data, uint16_t count);
+
+		ComPort::Result txData(std::vector<uint8_t> data);
+
+		// Set subscribe on event.
+		// RX_DATA - frame of channel was received, TX_DATA - frame of channel
+		// was passed to port (tx fifo of channel got place),
+		// SHUTDOWN - port was shutdown.
+		void setSubscribeOnEvent(ComPort::Event event, UpCallback callback);
+
+		// Reset subscribe on event.
+		void resetSubscribeOnEvent(ComPort::Event event, UpCallback callback);
+
+		uint8_t getChannelNum() const
+		{
+			return this->channelNum_;
+		}
+
+	private:
+		friend class ComPortMux;
+
+		Channel(ComPortMux& mux, uint8_t channelNum);
+
+		ComPortMux&					mux_;
+		uint8_t						channelNum_;
+
+		// Fields of rx, protected by mutex of mux.
+		std::deque<uint8_t>			rxQueue_;
+		uint8_t						rxEpoch_; // Epoch of stream of peer.
+		uint32_t					rxOffset_; // Offset of next expected data in stream.
+		uint32_t					rxConsumedCount_; // Count of data read by user or lost.
+		uint32_t					rxCreditSentCount_; // rxConsumedCount_ sent to peer last time.
+		bool						isCreditPending_;
+
+		// Fields of tx, protected by mutex of mux.
+		std::deque<uint8_t>			txQueue_;
+		uint32_t					txSentCount_; // Count of data sent to peer.
+		uint32_t					txPeerConsumedCount_; // Count of data read by peer.
+		bool						isProbeSent_; // Empty data frame was sent, while there is no credit.
+		std::chrono::steady_clock::time_point	txProbeTime_;
+
+		// Fields for handle callback.
+		std::vector<UpCallback>		rxDataCallbacks_;
+		std::vector<UpCallback>		txDataCallbacks_;
+		std::vector<UpCallback>		shutdownCallbacks_;
+		std::mutex					callbackMutex_;
+
+		std::vector<UpCallback>* getCallbacks(ComPort::Event event);
+
+		// Count data as read and give credit to peer, if enough place was freed.
+		// Call with locked mutex of mux.
+		void consume(uint32_t count);
+
+		// Start stream of peer from offset, because peer was restarted.
+		// Data in rx fifo is kept and it takes place until read.
+		// Call with locked mutex of mux.
+		void resyncRx(uint8_t epoch, uint32_t offset);
+
+		void callCallbacks(ComPort::Event event);
+	};
+
+	// channelCount - count of logical channels.
+	// channelBufferSize - size of rx and tx fifo of every channel.
+	// maxFramePayload - max count of channel data in one frame sent by this end
+	// (not more than 250). Frames of peer are received with any size.
+	ComPortMux(ComPort& comPort, uint8_t channelCount,
+			   uint16_t channelBufferSize = 512, uint8_t maxFramePayload = 64);
+
+	~ComPortMux();
+
+	ComPortMux(const ComPortMux&) = delete;
+	ComPortMux& operator=(const ComPortMux&) = delete;
+
+	uint8_t getChannelCount() const
+	{
+		return static_cast<uint8_t>(this->channels_.size());
+	}
+
+	// Channel number must be less than channel count.
+	Channel& getChannel(uint8_t channelNum)
+	{
+		return *this->channels_[channelNum];
+	}
+
+private:
+	// 32 bit fields of payload are little endian.
+	enum class FrameType : uint8_t
+	{
+		DATA, // Payload is 8 bit epoch of sender, 32 bit offset of data in stream
+			  // of channel, then data. Data frame without data is sent to get
+			  // credit, when there is no it.
+		CREDIT // Payload is 8 bit epoch of credited stream (epoch of peer),
+			   // 32 bit count of data read by user or lost.
+	};
+
+	enum class ParseState
+	{
+		SOF,
+		CHANNEL,
+		TYPE,
+		LENGTH,
+		PAYLOAD,
+		CRC
+	};
+
+	static const uint8_t		FRAME_SOF = 0xA5;
+	static const uint8_t		DATA_HEADER_SIZE = 1 + sizeof(uint32_t); // Epoch and offset.
+	static const uint8_t		CREDIT_SIZE = 1 + sizeof(uint32_t); // Epoch and count.
+	// Probe or credit for it can be lost, then probe is repeated after this
+	// time on next event of mux (rx of port, tx of port or call of channel).
+	static const std::chrono::milliseconds	PROBE_INTERVAL;
+
+	ComPort&					comPort_;
+	uint16_t					channelBufferSize_;
+	uint8_t						maxFramePayload_;
+	std::vector<std::unique_ptr<Channel>>	channels_;
+	std::mutex					mutex_;
+
+	// Fields of tx.
+	uint8_t						txEpoch_; // Epoch of streams of this mux.
+	uint8_t						txNextChannel_; // Channel to send first in next round.
+	bool						isTxFrameInWork_; // Frame is in tx fifo of port.
+	uint32_t					portOpenCount_; // Open count of port, which link state belongs to.
+
+	// Fields of rx frame parser.
+	RxBroadcast::SubscriberId	rxSubscriberId_;
+	ParseState					parseState_;
+	uint8_t						parseChannel_;
+	FrameType					parseType_;
+	uint8_t						parseLength_;
+	std::vector<uint8_t>		parsePayload_;
+	uint8_t						parseCrc_; // Crc of frame bytes after SOF.
+
+	// Callbacks set in ComPort, used to reset subscribe.
+	Callback*					rxDataCallback_;
+	Callback*					txDataCallback_;
+	Callback*					shutdownCallback_;
+
+	// Handle data received by port.
+	void onRxData();
+
+	// Handle end of tx of frame.
+	void onTxData();
+
+	// Handle shutdown of port.
+	void onShutdown();
+
+	// Forget frame in tx fifo of port, sent probes and partly parsed frame,
+	// because port was shutdown or reopened. Call with locked mutex.
+	void resetLinkState();
+
+	// Reset link state, if port was reopened. Call with locked mutex.
+	void checkPortReopen();
+
+	// Parse one byte of frame. Return number of channel, which got data,
+	// or channel count if there is no new data.
+	uint8_t parseByte(uint8_t byte);
+
+	// Send next frame, if there is no frame in tx fifo of port.
+	// Call with locked mutex. Return numbers of channels, which sent data.
+	std::vector<uint8_t> pumpTx();
+
+	// Call callbacks of event of channels. Call with unlocked mutex.
+	void callCallbacks(ComPort::Event event, const std::vector<uint8_t>& channelNums);
+
+	static uint32_t readUint32(const uint8_t* data);
+
+	static void writeUint32(uint32_t value, uint8_t* data);
+
+	// Continue calculation of crc with data.
+	static uint8_t calcCrc8(uint8_t crc, const uint8_t* data, size_t size);
+};
+
+} // kylsocomport
@@ -0,0 +1,191 @@
+#include "ComPortTrace.h"
+#include <windows.h>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace kylsocomport
+{
+
+namespace
+{
+
+struct TraceEvent
+{
+	int64_t			timeNs;
+	const char*		name;
+	uint32_t		count;
+	char			phase;
+};
+
+// Ring buffer of one thread. Only owner thread writes it.
+struct TraceBuffer
+{
+	DWORD									threadId;
+	std::string								threadName; // Protected by registry mutex.
+	bool									isUsed; // Protected by registry mutex.
+	std::array<TraceEvent, Trace::BUFFER_SIZE>	events;
+	std::atomic<uint64_t>					writeIndex;
+};
+
+// Buffers of all threads. Buffer of ended thread is kept, so its events
+// can be written later, until it is given to next new thread. So count of
+// buffers is limited by count of threads, which work at once.
+struct TraceRegistry
+{
+	std::mutex									mutex;
+	std::vector<std::unique_ptr<TraceBuffer>>	buffers;
+};
+
+TraceRegistry& getRegistry()
+{
+	static TraceRegistry registry;
+	return registry;
+}
+
+// Free buffer of thread at its end.
+struct ThreadBufferHolder
+{
+	TraceBuffer*	buffer = nullptr;
+
+	~ThreadBufferHolder()
+	{
+		if (this->buffer != nullptr)
+		{
+			std::lock_guard<std::mutex> lock(getRegistry().mutex);
+			this->buffer->isUsed = false;
+		}
+	}
+};
+
+TraceBuffer& getThreadBuffer()
+{
+	thread_local ThreadBufferHolder holder;
+	if (holder.buffer == nullptr)
+	{
+		TraceRegistry& registry = getRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		for (auto& buffer : registry.buffers)
+		{
+			if (!buffer->isUsed)
+			{
+				holder.buffer = buffer.get();
+				break;
+			}
+		}
+		if (holder.buffer == nullptr)
+		{
+			registry.buffers.emplace_back(new TraceBuffer);
+			holder.buffer = registry.buffers.back().get();
+		}
+		holder.buffer->threadId = GetCurrentThreadId();
+		holder.buffer->threadName.clear();
+		holder.buffer->isUsed = true;
+		holder.buffer->writeIndex.store(0, std::memory_order_relaxed);
+	}
+	return *holder.buffer;
+}
+
+void writeJsonString(std::ostream& stream, const char* text)
+{
+	stream << '"';
+	for (; *text != '\0'; text++)
+	{
+		if (*text == '"' || *text == '\\')
+		{
+			stream << '\\';
+		}
+		stream << *text;
+	}
+	stream << '"';
+}
+
+} // namespace
+
+const size_t Trace::BUFFER_SIZE;
+std::atomic<bool> Trace::isEnable_{false};
+
+void Trace::record(const char* name, char phase, uint32_t count)
+{
+	TraceBuffer& buffer = getThreadBuffer();
+	uint64_t index = buffer.writeIndex.load(std::memory_order_relaxed);
+	TraceEvent& event = buffer.events[index % BUFFER_SIZE];
+	event.timeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	event.name = name;
+	event.count = count;
+	event.phase = phase;
+	buffer.writeIndex.store(index + 1, std::memory_order_release);
+}
+
+void Trace::setThreadName(const char* name)
+{
+	TraceBuffer& buffer = getThreadBuffer();
+	std::lock_guard<std::mutex> lock(getRegistry().mutex);
+	buffer.threadName = name;
+}
+
+void Trace::writeChromeTrace(std::ostream& stream)
+{
+	TraceRegistry& registry = getRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	DWORD processId = GetCurrentProcessId();
+	bool isFirst = true;
+	auto writeHeader = [&](const TraceBuffer& buffer, const char* name, char phase)
+	{
+		stream << (isFirst ? "\n" : ",\n") << "{\"name\":";
+		writeJsonString(stream, name);
+		stream << ",\"ph\":\"" << phase << "\",\"pid\":" << processId
+			   << ",\"tid\":" << buffer.threadId;
+		isFirst = false;
+	};
+
+	stream << "{\"traceEvents\":[";
+	for (auto& buffer : registry.buffers)
+	{
+		if (!buffer->threadName.empty())
+		{
+			writeHeader(*buffer, "thread_name", 'M');
+			stream << ",\"args\":{\"name\":";
+			writeJsonString(stream, buffer->threadName.c_str());
+			stream << "}}";
+		}
+		uint64_t endIndex = buffer->writeIndex.load(std::memory_order_acquire);
+		uint64_t beginIndex = (endIndex > BUFFER_SIZE) ? endIndex - BUFFER_SIZE : 0;
+		for (uint64_t i = beginIndex; i < endIndex; i++)
+		{
+			const TraceEvent& event = buffer->events[i % BUFFER_SIZE];
+			writeHeader(*buffer, event.name, event.phase);
+			stream << ",\"ts\":" << event.timeNs / 1000 << '.'
+				   << static_cast<char>('0' + event.timeNs / 100 % 10)
+				   << static_cast<char>('0' + event.timeNs / 10 % 10)
+				   << static_cast<char>('0' + event.timeNs % 10);
+			if (event.phase == 'i')
+			{
+				stream << ",\"s\":\"t\"";
+			}
+			if (event.count != 0)
+			{
+				stream << ",\"args\":{\"bytes\":" << event.count << '}';
+			}
+			stream << '}';
+		}
+	}
+	stream << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+void Trace::clear()
+{
+	// Buffers are used by threads without lock, so they are only reset.
+	TraceRegistry& registry = getRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	for (auto& buffer : registry.buffers)
+	{
+		buffer->writeIndex.store(0, std::memory_order_relaxed);
+	}
+}
+
+} // kylsocomport
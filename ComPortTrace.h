@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+// Tracepoints of io path. They are compiled only with KYLSOCOMPORT_TRACE
+// defined (cmake option COMPORT_TRACE), else macros are empty.
+// Compiled tracepoints write events only after Trace::setEnable(true),
+// otherwise they cost one load of atomic flag.
+#ifdef KYLSOCOMPORT_TRACE
+#define COMPORT_TRACE_CONCAT_(a, b) a##b
+#define COMPORT_TRACE_CONCAT(a, b) COMPORT_TRACE_CONCAT_(a, b)
+#define COMPORT_TRACE_BEGIN(name) ::kylsocomport::Trace::begin(name)
+#define COMPORT_TRACE_END(name, count) ::kylsocomport::Trace::end(name, count)
+#define COMPORT_TRACE_INSTANT(name, count) ::kylsocomport::Trace::instant(name, count)
+#define COMPORT_TRACE_SCOPE(name) \
+	::kylsocomport::TraceScope COMPORT_TRACE_CONCAT(traceScope, __LINE__)(name)
+#define COMPORT_TRACE_THREAD_NAME(name) ::kylsocomport::Trace::setThreadName(name)
+#else
+#define COMPORT_TRACE_BEGIN(name) ((void)0)
+#define COMPORT_TRACE_END(name, count) ((void)0)
+#define COMPORT_TRACE_INSTANT(name, count) ((void)0)
+#define COMPORT_TRACE_SCOPE(name) ((void)0)
+#define COMPORT_TRACE_THREAD_NAME(name) ((void)0)
+#endif
+
+namespace kylsocomport
+{
+
+// Recorder of trace events. Every thread writes events into own ring buffer
+// without locks, the oldest events are overwritten. Buffer of ended thread
+// is reused by next new thread.
+// Names of events must be string literals (only pointer is stored).
+class Trace final
+{
+public:
+	// Count of events kept for every thread.
+	static const size_t BUFFER_SIZE = 1 << 14;
+
+	static void setEnable(bool isEnable)
+	{
+		isEnable_.store(isEnable, std::memory_order_relaxed);
+	}
+
+	static bool isEnable()
+	{
+		return isEnable_.load(std::memory_order_relaxed);
+	}
+
+	// Begin of duration event.
+	static void begin(const char* name)
+	{
+		if (isEnable())
+		{
+			record(name, 'B', 0);
+		}
+	}
+
+	// End of duration event, count - count of processed data.
+	static void end(const char* name, uint32_t count)
+	{
+		if (isEnable())
+		{
+			record(name, 'E', count);
+		}
+	}
+
+	// Event without duration, count - count of processed data.
+	static void instant(const char* name, uint32_t count)
+	{
+		if (isEnable())
+		{
+			record(name, 'i', count);
+		}
+	}
+
+	// Set name of current thread in trace.
+	static void setThreadName(const char* name);
+
+	// Write events of all threads in Chrome trace (Perfetto) json format.
+	// For exact result disable trace before it, else the oldest events
+	// can be overwritten while they are written.
+	static void writeChromeTrace(std::ostream& stream);
+
+	// Remove recorded events.
+	static void clear();
+
+private:
+	static std::atomic<bool>	isEnable_;
+
+	static void record(const char* name, char phase, uint32_t count);
+};
+
+// Duration event of scope.
+class TraceScope final
+{
+public:
+	explicit TraceScope(const char* name) :
+		name_(name)
+	{
+		Trace::begin(name);
+	}
+
+	~TraceScope()
+	{
+		Trace::end(this->name_, 0);
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	const char*		name_;
+};
+
+} // kylsocomport
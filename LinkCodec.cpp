@@ -0,0 +1,356 @@
+#include "LinkCodec.h"
+#include <algorithm>
+#include <cstring>
+
+namespace kylsocomport
+{
+
+namespace
+{
+
+const size_t MIN_MATCH = 4;
+const size_t MAX_OFFSET = 65535;
+const int HASH_BITS = 12;
+
+uint32_t read32(const uint8_t* data)
+{
+	uint32_t value;
+	std::memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+uint32_t hash32(uint32_t value)
+{
+	return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write length extension (bytes of 255 and rest). Return false if no place.
+bool writeLength(size_t length, uint8_t* dst, size_t& pos, size_t capacity)
+{
+	while (length >= 255)
+	{
+		if (pos >= capacity)
+		{
+			return false;
+		}
+		dst[pos++] = 255;
+		length -= 255;
+	}
+	if (pos >= capacity)
+	{
+		return false;
+	}
+	dst[pos++] = static_cast<uint8_t>(length);
+	return true;
+}
+
+// Read length extension. Return false on end of data.
+bool readLength(const uint8_t* src, size_t& pos, size_t size, size_t& length)
+{
+	uint8_t byte;
+	do
+	{
+		if (pos >= size)
+		{
+			return false;
+		}
+		byte = src[pos++];
+		length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+// Write sequence of literals and match (matchLength 0 - no match, last sequence).
+bool writeSequence(const uint8_t* literals, size_t literalLength, size_t offset,
+				   size_t matchLength, uint8_t* dst, size_t& pos, size_t capacity)
+{
+	if (pos >= capacity)
+	{
+		return false;
+	}
+	size_t matchCode = (matchLength != 0) ? matchLength - MIN_MATCH : 0;
+	size_t tokenPos = pos++;
+	dst[tokenPos] = static_cast<uint8_t>((std::min<size_t>(literalLength, 15) << 4) |
+										 std::min<size_t>(matchCode, 15));
+	if (literalLength >= 15 && !writeLength(literalLength - 15, dst, pos, capacity))
+	{
+		return false;
+	}
+	if (capacity - pos < literalLength)
+	{
+		return false;
+	}
+	std::memcpy(dst + pos, literals, literalLength);
+	pos += literalLength;
+	if (matchLength == 0)
+	{
+		return true;
+	}
+	if (capacity - pos < 2)
+	{
+		return false;
+	}
+	dst[pos++] = static_cast<uint8_t>(offset);
+	dst[pos++] = static_cast<uint8_t>(offset >> 8);
+	if (matchCode >= 15 && !writeLength(matchCode - 15, dst, pos, capacity))
+	{
+		return false;
+	}
+	return true;
+}
+
+} // namespace
+
+const size_t LinkCodec::MAX_BLOCK_SIZE;
+const uint8_t LinkCodec::FRAME_MAGIC;
+const uint8_t LinkCodec::FLAG_COMPRESSED;
+const size_t LinkCodec::HEADER_SIZE;
+const size_t LinkCodec::TRAILER_SIZE;
+
+LinkCodec::LinkCodec(uint16_t minCompressSize) :
+	minCompressSize_(minCompressSize)
+{
+}
+
+bool LinkCodec::encode(const std::vector<uint8_t>& data, std::vector<uint8_t>& frame) const
+{
+	size_t rawSize = data.size();
+	frame.resize(HEADER_SIZE + rawSize + TRAILER_SIZE);
+	size_t payloadSize = 0;
+	if (rawSize >= this->minCompressSize_)
+	{
+		// Compressed payload is useful only if it is smaller than stored one.
+		payloadSize = compressBlock(data.data(), rawSize, frame.data() + HEADER_SIZE, rawSize);
+	}
+	bool isCompressed = (payloadSize != 0);
+	if (!isCompressed)
+	{
+		payloadSize = rawSize;
+		std::copy(data.begin(), data.end(), frame.begin() + HEADER_SIZE);
+	}
+	frame[0] = FRAME_MAGIC;
+	frame[1] = isCompressed ? FLAG_COMPRESSED : 0;
+	frame[2] = static_cast<uint8_t>(rawSize);
+	frame[3] = static_cast<uint8_t>(rawSize >> 8);
+	frame[4] = static_cast<uint8_t>(payloadSize);
+	frame[5] = static_cast<uint8_t>(payloadSize >> 8);
+	frame[6] = calcCrc8(frame.data(), HEADER_SIZE - 1);
+	uint16_t crc = calcCrc16(frame.data() + HEADER_SIZE, payloadSize);
+	frame[HEADER_SIZE + payloadSize] = static_cast<uint8_t>(crc);
+	frame[HEADER_SIZE + payloadSize + 1] = static_cast<uint8_t>(crc >> 8);
+	frame.resize(HEADER_SIZE + payloadSize + TRAILER_SIZE);
+	return isCompressed;
+}
+
+void LinkCodec::countTxFrame(size_t rawSize, size_t frameSize, bool isCompressed)
+{
+	std::lock_guard<std::mutex> lock(this->statsMutex_);
+	this->stats_.txRawBytes += rawSize;
+	this->stats_.txWireBytes += frameSize;
+	if (isCompressed)
+	{
+		this->stats_.txCompressedFrames++;
+	}
+	else
+	{
+		this->stats_.txStoredFrames++;
+	}
+}
+
+void LinkCodec::decode(const uint8_t* data, size_t count, std::vector<uint8_t>& out)
+{
+	uint64_t rawBytes = 0, wireBytes = 0, badFrames = 0;
+	this->rxPending_.insert(this->rxPending_.end(), data, data + count);
+	size_t pos = 0;
+	while (true)
+	{
+		// Search begin of frame.
+		while (pos < this->rxPending_.size() && this->rxPending_[pos] != FRAME_MAGIC)
+		{
+			pos++;
+		}
+		const uint8_t* frame = this->rxPending_.data() + pos;
+		size_t size = this->rxPending_.size() - pos;
+		if (size < HEADER_SIZE)
+		{
+			break;
+		}
+		size_t rawSize = frame[2] | (static_cast<size_t>(frame[3]) << 8);
+		size_t payloadSize = frame[4] | (static_cast<size_t>(frame[5]) << 8);
+		bool isCompressed = (frame[1] & FLAG_COMPRESSED) != 0;
+		if (frame[6] != calcCrc8(frame, HEADER_SIZE - 1) || rawSize > MAX_BLOCK_SIZE ||
+			payloadSize > MAX_BLOCK_SIZE || (!isCompressed && payloadSize != rawSize))
+		{
+			pos++; // Not a frame, search next magic.
+			continue;
+		}
+		if (size < HEADER_SIZE + payloadSize + TRAILER_SIZE)
+		{
+			break;
+		}
+		const uint8_t* payload = frame + HEADER_SIZE;
+		uint16_t crc = payload[payloadSize] | (static_cast<uint16_t>(payload[payloadSize + 1]) << 8);
+		bool isGood = (crc == calcCrc16(payload, payloadSize));
+		if (isGood && isCompressed)
+		{
+			this->rxBlock_.resize(rawSize);
+			isGood = decompressBlock(payload, payloadSize, this->rxBlock_.data(), rawSize);
+			payload = this->rxBlock_.data();
+		}
+		if (!isGood)
+		{
+			badFrames++;
+			pos++;
+			continue;
+		}
+		out.insert(out.end(), payload, payload + rawSize);
+		rawBytes += rawSize;
+		wireBytes += HEADER_SIZE + payloadSize + TRAILER_SIZE;
+		pos += HEADER_SIZE + payloadSize + TRAILER_SIZE;
+	}
+	this->rxPending_.erase(this->rxPending_.begin(), this->rxPending_.begin() + pos);
+
+	if (rawBytes != 0 || badFrames != 0)
+	{
+		std::lock_guard<std::mutex> lock(this->statsMutex_);
+		this->stats_.rxRawBytes += rawBytes;
+		this->stats_.rxWireBytes += wireBytes;
+		this->stats_.rxBadFrames += badFrames;
+	}
+}
+
+void LinkCodec::resetDecoder()
+{
+	this->rxPending_.clear();
+}
+
+LinkCodec::Stats LinkCodec::getStats()
+{
+	std::lock_guard<std::mutex> lock(this->statsMutex_);
+	return this->stats_;
+}
+
+void LinkCodec::resetStats()
+{
+	std::lock_guard<std::mutex> lock(this->statsMutex_);
+	this->stats_ = Stats();
+}
+
+size_t LinkCodec::compressBlock(const uint8_t* src, size_t srcSize,
+								uint8_t* dst, size_t dstCapacity)
+{
+	// Position + 1 of last data with such hash, 0 - no data.
+	uint32_t table[1 << HASH_BITS] = {};
+	size_t pos = 0, anchor = 0, i = 0;
+	while (i + MIN_MATCH <= srcSize)
+	{
+		uint32_t sequence = read32(src + i);
+		uint32_t hash = hash32(sequence);
+		size_t candidate = table[hash];
+		table[hash] = static_cast<uint32_t>(i + 1);
+		if (candidate == 0 || i - (candidate - 1) > MAX_OFFSET ||
+			read32(src + candidate - 1) != sequence)
+		{
+			i++;
+			continue;
+		}
+		size_t match = candidate - 1;
+		size_t matchLength = MIN_MATCH;
+		while (i + matchLength < srcSize && src[match + matchLength] == src[i + matchLength])
+		{
+			matchLength++;
+		}
+		if (!writeSequence(src + anchor, i - anchor, i - match, matchLength, dst, pos, dstCapacity))
+		{
+			return 0;
+		}
+		i += matchLength;
+		anchor = i;
+	}
+	if (anchor < srcSize &&
+		!writeSequence(src + anchor, srcSize - anchor, 0, 0, dst, pos, dstCapacity))
+	{
+		return 0;
+	}
+	return (pos < dstCapacity) ? pos : 0;
+}
+
+bool LinkCodec::decompressBlock(const uint8_t* src, size_t srcSize,
+								uint8_t* dst, size_t dstSize)
+{
+	size_t in = 0, out = 0;
+	while (in < srcSize)
+	{
+		uint8_t token = src[in++];
+		size_t literalLength = token >> 4;
+		if (literalLength == 15 && !readLength(src, in, srcSize, literalLength))
+		{
+			return false;
+		}
+		if (srcSize - in < literalLength || dstSize - out < literalLength)
+		{
+			return false;
+		}
+		std::memcpy(dst + out, src + in, literalLength);
+		in += literalLength;
+		out += literalLength;
+		if (in == srcSize)
+		{
+			break; // Last sequence has no match.
+		}
+		if (srcSize - in < 2)
+		{
+			return false;
+		}
+		size_t offset = src[in] | (static_cast<size_t>(src[in + 1]) << 8);
+		in += 2;
+		size_t matchLength = token & 0x0F;
+		if (matchLength == 15 && !readLength(src, in, srcSize, matchLength))
+		{
+			return false;
+		}
+		matchLength += MIN_MATCH;
+		if (offset == 0 || offset > out || dstSize - out < matchLength)
+		{
+			return false;
+		}
+		// Match can overlap own data, so copy by bytes.
+		for (size_t i = 0; i < matchLength; i++, out++)
+		{
+			dst[out] = dst[out - offset];
+		}
+	}
+	return out == dstSize;
+}
+
+uint8_t LinkCodec::calcCrc8(const uint8_t* data, size_t size)
+{
+	// CRC-8, polynomial x^8 + x^2 + x + 1.
+	uint8_t crc = 0;
+	for (size_t i = 0; i < size; i++)
+	{
+		crc ^= data[i];
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = static_cast<uint8_t>((crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1));
+		}
+	}
+	return crc;
+}
+
+uint16_t LinkCodec::calcCrc16(const uint8_t* data, size_t size)
+{
+	// CRC-16/CCITT-FALSE.
+	uint16_t crc = 0xFFFF;
+	for (size_t i = 0; i < size; i++)
+	{
+		crc ^= static_cast<uint16_t>(data[i]) << 8;
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = static_cast<uint16_t>((crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1));
+		}
+	}
+	return crc;
+}
+
+} // kylsocomport
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <mutex>
+
+namespace kylsocomport
+{
+
+// Transparent compression of link data.
+// Data of every txData() call is sent in one frame:
+// [MAGIC][flags][raw size (2)][payload size (2)][crc8 of header][payload][crc16 of payload].
+// Payload is data compressed by LZ-style block codec (LZ4 sequence format)
+// or stored data, if it is short or does not compress.
+// Both ends of link must use compression.
+class LinkCodec final
+{
+public:
+	struct Stats
+	{
+		uint64_t	txRawBytes = 0; // Data given to encode().
+		uint64_t	txWireBytes = 0; // Frames made of it.
+		uint64_t	txCompressedFrames = 0;
+		uint64_t	txStoredFrames = 0;
+		uint64_t	rxRawBytes = 0; // Data got from frames.
+		uint64_t	rxWireBytes = 0; // Bytes of good frames.
+		uint64_t	rxBadFrames = 0; // Frames with bad crc or payload.
+	};
+
+	static const size_t MAX_BLOCK_SIZE = 4096;
+
+	// minCompressSize - data shorter than it is stored without compression,
+	// so short messages don't pay for it.
+	explicit LinkCodec(uint16_t minCompressSize);
+
+	void setMinCompressSize(uint16_t minCompressSize)
+	{
+		this->minCompressSize_ = minCompressSize;
+	}
+
+	uint16_t getMinCompressSize() const
+	{
+		return this->minCompressSize_;
+	}
+
+	// Make frame of data (size must not exceed MAX_BLOCK_SIZE).
+	// Return true if payload is compressed.
+	bool encode(const std::vector<uint8_t>& data, std::vector<uint8_t>& frame) const;
+
+	// Count frame made by encode() in statistics, when it was sent.
+	void countTxFrame(size_t rawSize, size_t frameSize, bool isCompressed);
+
+	// Parse received data, put data of complete frames into out.
+	// Call only from one thread (rx thread).
+	void decode(const uint8_t* data, size_t count, std::vector<uint8_t>& out);
+
+	// Drop partially received frame.
+	void resetDecoder();
+
+	Stats getStats();
+
+	void resetStats();
+
+	// Compress block. Return size of compressed data or 0, if it is not
+	// smaller than dstCapacity.
+	static size_t compressBlock(const uint8_t* src, size_t srcSize,
+								uint8_t* dst, size_t dstCapacity);
+
+	// Decompress block into exactly dstSize bytes. Return false on bad data.
+	static bool decompressBlock(const uint8_t* src, size_t srcSize,
+								uint8_t* dst, size_t dstSize);
+
+private:
+	static const uint8_t	FRAME_MAGIC = 0xC5;
+	static const uint8_t	FLAG_COMPRESSED = 0x01;
+	static const size_t		HEADER_SIZE = 7;
+	static const size_t		TRAILER_SIZE = 2;
+
+	uint16_t				minCompressSize_;
+	std::vector<uint8_t>	rxPending_; // Received data of not complete frame.
+	std::vector<uint8_t>	rxBlock_; // Buffer for decompressed block.
+	Stats					stats_;
+	std::mutex				statsMutex_;
+
+	static uint8_t calcCrc8(const uint8_t* data, size_t size);
+
+	static uint16_t calcCrc16(const uint8_t* data, size_t size);
+};
+
+} // kylsocomport
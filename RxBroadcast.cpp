@@ -0,0 +1,195 @@
+#include "RxBroadcast.h"
+#include <algorithm>
+#include <cstring>
+
+namespace kylsocomport
+{
+
+RxBroadcast::RxBroadcast(size_t capacity) :
+	buffer_(capacity)
+{
+	this->writePos_ = 0;
+	this->nextSubscriberId_ = 0;
+	this->isShutdown_ = false;
+}
+
+bool RxBroadcast::setCapacity(size_t capacity)
+{
+	std::lock_guard<std::mutex> lock(this->mutex_);
+	if (!this->subscribers_.empty() || capacity == 0)
+	{
+		return false;
+	}
+	this->buffer_.assign(capacity, 0);
+	return true;
+}
+
+size_t RxBroadcast::getCapacity() const
+{
+	std::lock_guard<std::mutex> lock(this->mutex_);
+	return this->buffer_.size();
+}
+
+RxBroadcast::SubscriberId RxBroadcast::subscribe(SlowPolicy policy)
+{
+	std::lock_guard<std::mutex> lock(this->mutex_);
+	SubscriberId id = this->nextSubscriberId_++;
+	this->subscribers_[id] = Subscriber{policy, this->writePos_, 0, false};
+	return id;
+}
+
+void RxBroadcast::unsubscribe(SubscriberId id)
+{
+	std::lock_guard<std::mutex> lock(this->mutex_);
+	this->subscribers_.erase(id);
+	this->releaseWriter_.notify_one();
+}
+
+RxBroadcast::View RxBroadcast::peek(SubscriberId id)
+{
+	View view;
+	std::lock_guard<std::mutex> lock(this->mutex_);
+	auto i = this->subscribers_.find(id);
+	if (i == this->subscribers_.end())
+	{
+		return view;
+	}
+	Subscriber& subscriber = i->second;
+	size_t count = static_cast<size_t>(this->writePos_ - subscriber.cursor);
+	if (count == 0)
+	{
+		return view;
+	}
+	size_t start = static_cast<size_t>(subscriber.cursor % this->buffer_.size());
+	view.first = this->buffer_.data() + start;
+	view.firstSize = std::min(count, this->buffer_.size() - start);
+	if (view.firstSize < count)
+	{
+		view.second = this->buffer_.data();
+		view.secondSize = count - view.firstSize;
+	}
+	subscriber.isPinned = true;
+	return view;
+}
+
+void RxBroadcast::release(SubscriberId id, size_t count)
+{
+	std::lock_guard<std::mutex> lock(this->mutex_);
+	auto i = this->subscribers_.find(id);
+	if (i == this->subscribers_.end())
+	{
+		return;
+	}
+	Subscriber& subscriber = i->second;
+	subscriber.cursor += std::min<uint64_t>(count, this->writePos_ - subscriber.cursor);
+	subscriber.isPinned = false;
+	this->releaseWriter_.notify_one();
+}
+
+size_t RxBroadcast::read(SubscriberId id, std::vector<uint8_t>& data, size_t count)
+{
+	View view = this->peek(id);
+	size_t firstCount = std::min(count, view.firstSize);
+	size_t secondCount = std::min(count - firstCount, view.secondSize);
+	data.insert(data.end(), view.first, view.first + firstCount);
+	data.insert(data.end(), view.second, view.second + secondCount);
+	this->release(id, firstCount + secondCount);
+	return firstCount + secondCount;
+}
+
+size_t RxBroadcast::getLag(SubscriberId id)
+{
+	std::lock_guard<std::mutex> lock(this->mutex_);
+	auto i = this->subscribers_.find(id);
+	if (i == this->subscribers_.end())
+	{
+		return 0;
+	}
+	return static_cast<size_t>(this->writePos_ - i->second.cursor);
+}
+
+uint64_t RxBroadcast::getDropCount(SubscriberId id)
+{
+	std::lock_guard<std::mutex> lock(this->mutex_);
+	auto i = this->subscribers_.find(id);
+	if (i == this->subscribers_.end())
+	{
+		return 0;
+	}
+	return i->second.dropCount;
+}
+
+size_t RxBroadcast::write(const uint8_t* data, size_t count)
+{
+	std::unique_lock<std::mutex> lock(this->mutex_);
+	if (this->subscribers_.empty())
+	{
+		// Nobody read data, so it can be skipped.
+		this->writePos_ += count;
+		return count;
+	}
+	size_t written = 0;
+	while (written < count && !this->isShutdown_)
+	{
+		this->dropSlow(std::min(count - written, this->buffer_.size()));
+		size_t freeSize = this->buffer_.size() -
+			static_cast<size_t>(this->writePos_ - this->getTailPos());
+		if (freeSize == 0)
+		{
+			this->releaseWriter_.wait(lock);
+			continue;
+		}
+		size_t part = std::min(freeSize, count - written);
+		size_t start = static_cast<size_t>(this->writePos_ % this->buffer_.size());
+		size_t firstPart = std::min(part, this->buffer_.size() - start);
+		std::memcpy(this->buffer_.data() + start, data + written, firstPart);
+		std::memcpy(this->buffer_.data(), data + written + firstPart, part - firstPart);
+		this->writePos_ += part;
+		written += part;
+	}
+	return written;
+}
+
+void RxBroadcast::shutdown()
+{
+	std::lock_guard<std::mutex> lock(this->mutex_);
+	this->isShutdown_ = true;
+	this->releaseWriter_.notify_one();
+}
+
+void RxBroadcast::start()
+{
+	std::lock_guard<std::mutex> lock(this->mutex_);
+	this->isShutdown_ = false;
+}
+
+uint64_t RxBroadcast::getTailPos() const
+{
+	uint64_t tailPos = this->writePos_;
+	for (auto& i : this->subscribers_)
+	{
+		tailPos = std::min(tailPos, i.second.cursor);
+	}
+	return tailPos;
+}
+
+void RxBroadcast::dropSlow(size_t count)
+{
+	if (this->writePos_ + count <= this->buffer_.size())
+	{
+		return;
+	}
+	uint64_t minCursor = this->writePos_ + count - this->buffer_.size();
+	for (auto& i : this->subscribers_)
+	{
+		Subscriber& subscriber = i.second;
+		if (subscriber.policy == SlowPolicy::DROP && !subscriber.isPinned &&
+			subscriber.cursor < minCursor)
+		{
+			subscriber.dropCount += minCursor - subscriber.cursor;
+			subscriber.cursor = minCursor;
+		}
+	}
+}
+
+} // kylsocomport
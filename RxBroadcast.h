@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+namespace kylsocomport
+{
+
+// Ring buffer of received data with many readers.
+// Every subscriber has own read cursor and reads data without copy.
+// Memory is reused after all cursors passed it.
+class RxBroadcast final
+{
+public:
+	using SubscriberId = uint32_t;
+
+	// Behavior of writer if subscriber does not read data in time.
+	enum class SlowPolicy
+	{
+		DROP,	// Drop oldest unread data of subscriber.
+		BLOCK	// Wait until subscriber read data (rx thread stop reading of port).
+	};
+
+	// Unread data of subscriber. Because of ring wrap data can lie in two parts.
+	struct View
+	{
+		const uint8_t*	first = nullptr;
+		size_t			firstSize = 0;
+		const uint8_t*	second = nullptr;
+		size_t			secondSize = 0;
+
+		size_t size() const
+		{
+			return this->firstSize + this->secondSize;
+		}
+	};
+
+	explicit RxBroadcast(size_t capacity);
+
+	// Change capacity of buffer. Possible only if there is no subscribers.
+	bool setCapacity(size_t capacity);
+
+	size_t getCapacity() const;
+
+	// Add subscriber. It reads data received after subscription.
+	SubscriberId subscribe(SlowPolicy policy);
+
+	void unsubscribe(SubscriberId id);
+
+	// Get unread data of subscriber. Data is valid and is not dropped until
+	// release() call, so view should be hold for short time only.
+	View peek(SubscriberId id);
+
+	// Move cursor of subscriber by count of read data.
+	void release(SubscriberId id, size_t count);
+
+	// Copy up to count of unread data into vector and move cursor.
+	// Return count of read data.
+	size_t read(SubscriberId id, std::vector<uint8_t>& data, size_t count);
+
+	// Return count of unread data of subscriber.
+	size_t getLag(SubscriberId id);
+
+	// Return count of data dropped for subscriber by DROP policy.
+	uint64_t getDropCount(SubscriberId id);
+
+	// Put data into buffer. Call only from one thread (rx thread).
+	// Can block while BLOCK subscribers read data.
+	// Return count of written data (less than count only after shutdown()).
+	size_t write(const uint8_t* data, size_t count);
+
+	// Release blocked writer and make write() do nothing.
+	void shutdown();
+
+	// Make write() work again after shutdown().
+	void start();
+
+private:
+	struct Subscriber
+	{
+		SlowPolicy	policy;
+		uint64_t	cursor; // Position of next unread byte.
+		uint64_t	dropCount;
+		bool		isPinned; // Data was given by peek() and not released yet.
+	};
+
+	std::vector<uint8_t>				buffer_;
+	uint64_t							writePos_; // Position of next written byte.
+	std::map<SubscriberId, Subscriber>	subscribers_;
+	SubscriberId						nextSubscriberId_;
+	bool								isShutdown_;
+	mutable std::mutex					mutex_;
+	std::condition_variable				releaseWriter_;
+
+	// Return position of oldest data, which is not read by some subscriber.
+	uint64_t getTailPos() const;
+
+	// Drop oldest data of not pinned DROP subscribers, so count of data can be written.
+	void dropSlow(size_t count);
+};
+
+} // kylsocomport